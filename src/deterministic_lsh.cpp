@@ -7,181 +7,190 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <numeric>
 #include <random>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
-using namespace std;
+#include "lsh_kernels.h"
+#include "lsh_index.h"
+#include "point_loader.h"
+#include "projection_family.h"
 
-using Point = vector<bool>;
+using namespace std;
 
-// LSH data structure
-vector<vector<int>> projection;         // random projection family
-vector<unordered_map<int64_t, vector<int>>> hash_table;
+NearNeighborIndex lsh;                  // LSH data structure
 
 // build LSH constructions from input data points
-void buildNearNeighborStruct(const int param_c,
-                             const int param_r,
-                             const int param_d,
-                             const int param_n,
-                             const int param_family,
-                             const vector<Point>& data) {
-        // compute LSH parameters
-        assert(param_r + 1 < 30);                       // TODO larger r requires too much memory
-        int param_b, param_q, param_t;
-        int family = param_family;
-        if (family != 1 && family != 2) {
-                        if (param_r > static_cast<int>(ceil(static_cast<double>(param_n)) / param_c))
-                                family = 2;
-                else
-                        family = 1;
-        }
-        switch (family) {
-                case 1: {
-                        param_b = 1;
-                        param_q = 1;
-                        param_t = static_cast<int>(ceil(log2(static_cast<double>(param_n)) / param_c / param_r));
-                        break;
-                }
-                case 2: {
-                        param_b = param_r;
-                        param_q = 2 * static_cast<int>(ceil(log(static_cast<double>(param_n)) / param_c));
-                        param_t = 1;
-                        break;
-                }
-                default: {
-                        assert(false);  // only two available parameter settings for projection family
-                }
-        }
-        const int param_R = static_cast<int>(floor(param_r * param_q / param_b));       // parameter r'
-        const int param_L = (1 << (param_t * param_R + 1)) - 1;         // use L = 2^(tr'+1)-1 hash functions for every partition
-                                                                        // b*L hash functions in total
-        cerr << "family = " << family << endl
-             << "b = " << param_b << endl
-             << "q = " << param_q << endl
-             << "t = " << param_t << endl
-             << "r' = " << param_R << endl
-             << "L = " << param_L << endl
-             << "#functions = " << param_b * param_L << endl;
+void buildNearNeighborStruct(const Family& f,
+                             const int param_d) {
+        assert(f.L > 0);                                // TODO larger r requires too much memory
+        cerr << "family = " << f.family << endl
+             << "b = " << f.b << endl
+             << "q = " << f.q << endl
+             << "t = " << f.t << endl
+             << "r' = " << f.R << endl
+             << "L = " << f.L << endl
+             << "#functions = " << f.b * f.L << endl;
 
-        // initialize hamming projection family
-        default_random_engine generator;
-        vector<int> p_start;            // random intervals function
-        auto die = bind(uniform_int_distribution<int>(1, param_b), generator);
-        for (int i {1}; i <= param_d; ++i) {
-                p_start.push_back(die());
-        }
-        projection.resize(param_b * param_L);
-        auto dice = bind(uniform_int_distribution<int>(0, param_L), generator);
-        // for each i, check if a(v,k)_i = 1, if yes, then add (i-1) to projection[(k-1)*L + (v-1)]
-        for (int i {1}; i <= param_d; ++i) {
-                for (int k {1}; k <= param_b; ++k) {
-                        // compute p^-1(k)_i, if 0, then check next k
-                        // essentially check whether k is in the wrap-around q-length interval starting from p_start[i-1]
-                        if (!((p_start[i - 1] <= k && k < p_start[i - 1] + param_q) ||
-                              (p_start[i - 1] > k && k + param_b < p_start[i - 1] + param_q)))
-                                continue;
-                        // use all v in {0,1}^(tr'+1)\{0}
-                        for (int v = 1; v <= param_L; ++v) {
-                                bool result_one = false;
-                                for (int j {0}; j < param_t; ++j) {
-                                        int m = dice();
-                                        int p = (m & v);        // bitwise conjunction
-                                        bool w = false;         // compute parity
-                                        while (p) {
-                                                p &= (p - 1);
-                                                w = !w;
-                                        }
-                                        if (w) {                // shortcut for disjunction
-                                                result_one =  true;
-                                                break;
-                                        }
-                                }
-                                if (result_one) {
-                                        projection[(k - 1) * param_L + (v - 1)].push_back(i - 1);
-                                }
-                        }
-                }
-        }
+        lsh.projection = buildProjection(f, param_d);
 
         // add data points (indices) to hash tables
-        hash_table.resize(param_b * param_L);
-        for (int i {0}; i < param_n; ++i) {
-                for (int j {0}, sz{static_cast<int>(hash_table.size())}; j < sz; ++j) {
-                        int64_t bucket {0};
-                        for (const auto& k : projection[j]) {
-                                bucket = bucket * 2 + data[i][k];       // TODO bucket may overflow
-                        }
-                        if (hash_table[j].find(bucket) == hash_table[j].end()) {
-                                hash_table[j].emplace(bucket, vector<int>());
-                        }
-                        hash_table[j][bucket].push_back(i);
-                }
-        }
+        addPoints(lsh);
 }
 
-// return all indices of near neighbors within distance threshold r
-vector<int> getNearNeighbors(const Point& point,
-                             const int threshold,
-                             const vector<Point>& data) {
-        unordered_set<int> candidates;
-        for (int i {0}, L {static_cast<int>(projection.size())}; i < L; ++i) {
-                int64_t bucket {0};
-                for (const auto& j : projection[i]) {
-                        bucket = bucket * 2 + point[j];
-                }
-                if (hash_table[i].find(bucket) == hash_table[i].end()) {
-                        continue;
+// auto-tuning: sample sizes used to measure bucket sizes, recall and operation costs
+const int tune_sample_data {2000};
+const int tune_sample_query {200};
+const int tune_sample_functions {16};   // hash functions drawn per candidate setting
+const int tune_sample_pairs {500};      // r-near (query, data) pairs used to measure recall
+const int tune_scan_points {50000};     // data points scanned for r-near pairs
+const int tune_max_t {3};
+
+// predicted cost of one LSH setting
+struct TuneEstimate {
+        Family f;
+        double recall;                  // fraction of sampled r-near pairs found
+        double memory;                  // index size in bytes
+        double collisions;              // bucket entries visited per query
+        double candidates;              // distinct candidates per query
+        double time;                    // nanoseconds per query
+};
+
+// pick the family parameters (b, q, t) minimizing the predicted query time subject to a
+// target recall and an index memory budget; bucket sizes are measured by hashing a sample
+// of the data and queries with some of the functions of each candidate setting, and recall
+// by checking which sampled r-near pairs share a bucket under any of its functions; a setting
+// whose buckets exceed the scan fraction is predicted to cost a linear scan at scan_cost per point
+TuneEstimate autoTuneFamily(const int param_r,
+                            const int param_d,
+                            const int param_family,
+                            const double param_recall,
+                            const double param_memory,
+                            const double scan_cost,
+                            const PackedPoints& data,
+                            const PackedPoints& query) {
+        const int param_n {data.n};
+        default_random_engine generator;
+        vector<int> order(param_n);
+        iota(order.begin(), order.end(), 0);
+        shuffle(order.begin(), order.end(), generator);
+        const int words {data.words};
+        const vector<int> ids(order.begin(), order.begin() + min(param_n, tune_sample_data));
+        const vector<Word> sample {gatherPoints(data, ids)};            // sampled points, packed like the index
+        const int s {static_cast<int>(ids.size())};
+        const vector<Word>& from {query.n > 0 ? query.data : sample};   // queries, or else the sample itself
+        const int nq {min(query.n > 0 ? query.n : s, tune_sample_query)};
+        const vector<Word> queries(from.begin(), from.begin() + static_cast<size_t>(nq) * words);
+
+        // coordinates where the query and data point of each sampled r-near pair differ
+        vector<vector<int>> near_pairs;
+        for (int i {0}; i < min(param_n, tune_scan_points) && static_cast<int>(near_pairs.size()) < tune_sample_pairs; ++i) {
+                const Word* point {data.data.data() + static_cast<size_t>(order[i]) * words};
+                for (int q {0}; q < nq; ++q) {
+                        const Word* query_point {queries.data() + static_cast<size_t>(q) * words};
+                        if (packedDistance(query_point, point, words) > param_r)
+                                continue;
+                        vector<int> diff;
+                        for (int w {0}; w < words; ++w) {
+                                for (Word bits {query_point[w] ^ point[w]}; bits; bits &= bits - 1)
+                                        diff.push_back(w * 64 + __builtin_ctzll(bits));
+                        }
+                        near_pairs.push_back(diff);
                 }
-                candidates.insert(hash_table[i][bucket].begin(), hash_table[i][bucket].end());
         }
 
-        // validate if near neighbors are within r
-        vector<int> result;
-        for (const auto& j : candidates) {
-                int distance {0};
-                for (int i {0}, d {static_cast<int>(point.size())}; i < d; ++i)
-                        distance += (point[i] != data[j][i]);
-                if (distance <= threshold)
-                        result.push_back(j);
+        TuneEstimate best {Family {0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0};
+        if (near_pairs.empty()) {
+                cerr << "warning: no r-near pairs in the sample, recall cannot be measured" << endl;
+                return best;
         }
-        return result;
-}
 
-// convert from bit string to bit vector
-Point toPoint(const string& s) {
-        vector<bool> point(s.length());
-        for (int i {0}; s[i]; ++i) {
-                point[i] = s[i] - '0';
-        }
-        return point;
-}
+        const OpCosts cost {measureOpCosts(sample, queries, words, param_d, param_n)};
+        cerr << "measured costs (ns): hash/bit = " << cost.hash
+             << ", lookup = " << cost.lookup
+             << ", collision = " << cost.collision
+             << ", verify = " << cost.verify
+             << ", query = " << cost.query << endl
+             << "sampled " << near_pairs.size() << " r-near pairs for recall" << endl;
 
-// convert from bit vector to bit string
-string toString(const Point& point) {
-        string s(point.size(), '0');
-        for (int i {0}; s[i]; ++i) {
-                if (point[i])
-                        s[i] = '1';
-        }
-        return s;
-}
+        cerr << "family\tb\tq\tt\t#functions\trecall\tMB\tcollisions\tcandidates\tus/query" << endl;
+        uniform_int_distribution<int> pick;
+        for (int b {1}; b <= param_r; ++b) {
+                const int family {b == 1 ? 1 : 2};
+                if (param_family == (family == 1 ? 2 : 1))
+                        continue;
+                for (int q {1}; q <= b; ++q) {
+                        for (int t {1}; t <= tune_max_t; ++t) {
+                                const Family f {makeFamily(family, param_r, b, q, t)};
+                                if (f.L == 0 ||
+                                    static_cast<double>(f.b) * f.L * param_n * sizeof(int) > param_memory)
+                                        continue;               // cannot even store the indices
+                                const vector<vector<int>> proj {buildProjection(f, param_d)};
+                                const int functions {static_cast<int>(proj.size())};
+                                double coordinates {0};
+                                for (const auto& p : proj)
+                                        coordinates += p.size();
+
+                                // a pair is found if one function avoids every coordinate where it differs
+                                int found {0};
+                                for (const auto& diff : near_pairs) {
+                                        for (const auto& p : proj) {
+                                                bool avoids {true};
+                                                for (const auto& j : diff) {
+                                                        if (binary_search(p.begin(), p.end(), j)) {
+                                                                avoids = false;
+                                                                break;
+                                                        }
+                                                }
+                                                if (avoids) {
+                                                        ++found;
+                                                        break;
+                                                }
+                                        }
+                                }
 
-// read points from file, where each line is a point in hamming space
-// each point is represented by a bit string of 0 and 1, deliminated by new lines
-// assuming all points have same dimension, i.e. the length of the bit string
-vector<Point> readPointsFromFile(const string& file) {
-        ifstream fin {file};
-        assert(fin.is_open());
+                                // fraction of the data sharing a query's bucket, and #buckets, for one function
+                                double collide {0}, buckets {0};
+                                for (int k {0}; k < tune_sample_functions; ++k) {
+                                        const PackedFunction function {
+                                                packFunction(proj[pick(generator, decltype(pick)::param_type(0, functions - 1))])};
+                                        unordered_map<int64_t, int> count;
+                                        for (int i {0}; i < s; ++i)
+                                                ++count[packedBucketOf(function, sample.data() + static_cast<size_t>(i) * words)];
+                                        buckets += count.size();
+                                        for (int q {0}; q < nq; ++q) {
+                                                auto it = count.find(packedBucketOf(function,
+                                                                                    queries.data() + static_cast<size_t>(q) * words));
+                                                if (it != count.end())
+                                                        collide += it->second;
+                                        }
+                                }
+                                collide /= static_cast<double>(tune_sample_functions) * nq * s;
+                                buckets = buckets / tune_sample_functions * param_n / s;
 
-        vector<Point> points;
-        string point_str;
-        while (fin >> point_str) {
-                points.push_back(toPoint(point_str));   // no checking for point dimension
+                                TuneEstimate e;
+                                e.f = f;
+                                e.recall = static_cast<double>(found) / near_pairs.size();
+                                e.memory = functions * (tableBytes(buckets, param_n) + sizeof(vector<int>))
+                                           + coordinates * sizeof(int);
+                                e.collisions = functions * collide * param_n;
+                                e.candidates = param_n * (1 - pow(1 - collide, functions));
+                                e.time = cost.query + coordinates * cost.hash + functions * cost.lookup
+                                         + (e.collisions > lsh.scan_fraction * param_n
+                                            ? param_n * scan_cost       // the query's buckets are scanned instead
+                                            : e.collisions * cost.collision + e.candidates * cost.verify);
+                                cerr << f.family << '\t' << f.b << '\t' << f.q << '\t' << f.t << '\t' << functions << '\t'
+                                     << e.recall << '\t' << e.memory / (1 << 20) << '\t'
+                                     << e.collisions << '\t' << e.candidates << '\t' << e.time / 1000 << endl;
+                                if (e.memory <= param_memory && e.recall >= param_recall &&
+                                    (best.f.L == 0 || e.time < best.time))
+                                        best = e;
+                        }
+                }
         }
-        return points;
+        return best;
 }
 
 // perform r-near neighbor search
@@ -189,12 +198,19 @@ void NearNeighborSearch(const string& data_file,
                         const string& query_file,
                         const int param_r,                              // r-near
                         const int param_c,                              // c-approximate
-                        const int param_family) {                       // hamming projection family
-        const vector<Point> data {readPointsFromFile(data_file)};       // data points
-        const vector<Point> query {readPointsFromFile(query_file)};     // query points
-        const int param_n {static_cast<int>(data.size())};              // number of data points
+                        const int param_family,                         // hamming projection family
+                        const double param_memory,                      // index memory budget in MB, 0 to skip tuning
+                        const double param_recall,                      // target recall when tuning
+                        const double param_scan) {                      // scan fraction, negative to calibrate
+        PackedPoints data {readPointsFromFile(data_file)};              // data points, packed
+        const PackedPoints query {readPointsFromFile(query_file)};      // query points, packed
+        const int param_n {data.n};                                     // number of data points
         assert(param_n > 0);
-        const int param_d {static_cast<int>(data.at(0).size())};        // dimension of points
+        const int param_d {data.d};                                     // dimension of points
+        if (query.n > 0 && query.d != param_d) {
+                cerr << "query points have dimension " << query.d << ", data points " << param_d << endl;
+                exit(EXIT_FAILURE);
+        }
         assert(param_r > 0);
 
         // echo input parameters
@@ -202,44 +218,99 @@ void NearNeighborSearch(const string& data_file,
              << "c = " << param_c << endl
              << "d = " << param_d << endl
              << "n = " << param_n << endl
-             << "#query = " << query.size() << endl;
+             << "#query = " << query.n << endl
+             << "isa = " << kernels().name << endl;
 
-        // build LSH construction and add data points
+        // switch to a linear scan once merging buckets is predicted to be slower; calibrated before
+        // tuning, which predicts a scan for the settings whose buckets exceed the scan fraction
+        double scan_cost {0};                   // nanoseconds per data point of a linear scan
+        const double calibrated {param_scan < 0 || param_memory > 0
+                                 ? calibrateScanFraction(data.data, data.words, scan_cost) : 0};
+        lsh.scan_fraction = param_scan >= 0 ? param_scan : calibrated;
+        cerr << "scan fraction = " << lsh.scan_fraction << endl;
+
+        // choose the projection family, either from the analysis or by measuring candidate settings
         using namespace std::chrono;
+        TuneEstimate tuned {Family {0, 0, 0, 0, 0, 0}, 0, 0, 0, 0, 0};
+        if (param_memory > 0) {
+                cerr << "memory budget = " << param_memory << "MB" << endl
+                     << "target recall = " << param_recall << endl;
+                auto tune_start = high_resolution_clock::now();
+                tuned = autoTuneFamily(param_r, param_d, param_family, param_recall, param_memory * (1 << 20),
+                                       scan_cost, data, query);
+                auto tune_duration = duration_cast<milliseconds>(high_resolution_clock::now() - tune_start);
+                cerr << "Parameters tuned in " << tune_duration.count() << "ms" << endl;
+                if (tuned.f.L == 0)
+                        cerr << "No setting is known to meet the recall within the memory budget, using default parameters" << endl;
+        }
+        const Family family {tuned.f.L > 0 ? tuned.f : chooseFamily(param_c, param_r, param_n, param_family)};
+
+        // build LSH construction and add data points
+        lsh.packed_words = data.words;
+        lsh.packed_data = move(data.data);
         auto build_start = high_resolution_clock::now();
-        buildNearNeighborStruct(param_c, param_r, param_d, param_n, param_family,
-                                data);
+        buildNearNeighborStruct(family, param_d);
         auto build_end = high_resolution_clock::now();
         auto build_duration = duration_cast<milliseconds>(build_end - build_start);
         cerr << "Data structure built in " << build_duration.count() << "ms" << endl;
 
         // query and output results
+        double search_ns {0};           // time spent in getNearNeighbors, excluding output
         auto query_start = high_resolution_clock::now();
-        for (int i {0}, sz {static_cast<int>(query.size())}; i < sz; ++i) {
-                vector<int> result {getNearNeighbors(query[i], param_r,
-                                                     data)};  // result is a vector of index for points in data
+        for (int i {0}; i < query.n; ++i) {
+                auto search_start = high_resolution_clock::now();
+                bool scanned;
+                vector<int> result {getNearNeighbors(lsh, query.data.data() + static_cast<size_t>(i) * query.words,
+                                                     param_r, scanned)};        // result is a vector of index for points in data
+                search_ns += elapsedNs(search_start);
 
                 // TODO should disable output for measuring query performance
-                cout << "Query point " << i << ": found " << result.size() << " NNs\n";
+                cout << "Query point " << i << ": found " << result.size() << " NNs by " << (scanned ? "scan" : "lsh") << "\n";
                 for (const auto& p : result) {
-                        cout << toString(data.at(p)) << '\n';
+                        cout << toString(unpackPoint(lsh.packed_data.data() + static_cast<size_t>(p) * lsh.packed_words, param_d))
+                             << '\n';
                 }
         }
         auto query_end = high_resolution_clock::now();
         auto query_duration = duration_cast<milliseconds>(query_end - query_start);
-        cerr << "Querying completed in " << query_duration.count() << "ms" << endl;
+        cerr << "Querying completed in " << query_duration.count() << "ms" << endl
+             << "#queries answered by scan = " << lsh.stat_scans << endl;
+
+        if (tuned.f.L > 0 && query.n > 0) {
+                const double nq {static_cast<double>(query.n)};
+                const int64_t merged {query.n - lsh.stat_scans};       // queries answered from their buckets
+                cerr << "predicted vs actual per query:" << endl
+                     << "  collisions = " << tuned.collisions << " vs " << lsh.stat_collisions / nq << endl
+                     << "  candidates = " << tuned.candidates << " vs ";
+                if (merged > 0)
+                        cerr << static_cast<double>(lsh.stat_candidates) / merged << " (over the " << merged
+                             << " queries answered by lsh)" << endl;
+                else
+                        cerr << "none (every query answered by scan)" << endl;
+                cerr << "  time = " << tuned.time / 1000 << "us vs " << search_ns / nq / 1000 << "us" << endl
+                     << "  index memory = " << tuned.memory / (1 << 20) << "MB vs " << indexBytes(lsh) / (1 << 20) << "MB" << endl;
+        }
 }
 
 int main(int argc, char* argv[]) {
-        if (argc != 5 && argc != 6) {
-                cerr << "Usage: " << argv[0] << " R C DataFile QueryFile [Family]\n"
+        parseIsaFlag(argc, argv);
+        if (argc < 5 || argc > 9) {
+                cerr << "Usage: " << argv[0] << " [--isa=NAME] R C DataFile QueryFile [Family] [MemoryMB] [Recall] [ScanFraction]\n"
+                     << "       --isa=NAME      (optional) run the kernels built for NAME, one of " << supportedKernels() << "\n"
+                     << "                       by default the first one, the fastest this cpu supports\n"
                      << "       R               retrieve all points within hamming distance R\n"
                      << "       C               approximation factor\n"
                      << "       DataFile        file containing all data points of the same dimension\n"
                      << "                       each point represented as a binary string in a line\n"
                      << "       QueryFile       file containing all query points\n"
                      << "       Family          choose hamming projection family H_A1 or H_A2\n"
-                     << "                       by default, if cr<log(n) use H_A1; otherwise, use H_A2\n";
+                     << "                       by default, if cr<log(n) use H_A1; otherwise, use H_A2\n"
+                     << "       MemoryMB        (optional) auto-tune b, q and t for the fastest predicted query time\n"
+                     << "                       within MemoryMB of index memory; Family 0 tunes both families\n"
+                     << "       Recall          (optional) minimum recall measured on sampled r-near pairs when tuning\n"
+                     << "                       default recall is 0.9\n"
+                     << "       ScanFraction    (optional) scan all points when the query's buckets hold more than\n"
+                     << "                       ScanFraction * n entries; by default calibrated from measured costs\n";
                 return EXIT_FAILURE;
         }
 
@@ -248,10 +319,20 @@ int main(int argc, char* argv[]) {
         const string data_file {argv[3]};
         const string query_file {argv[4]};
         int param_family {0};   // automatically choose projection family based on cr<>log(n)
-        if (argc == 6)
+        if (argc >= 6)
                 param_family = stoi(argv[5]);
+        double param_memory {0};                // by default no auto-tuning
+        if (argc >= 7)
+                param_memory = stod(argv[6]);
+        double param_recall {0.9};
+        if (argc >= 8)
+                param_recall = stod(argv[7]);
+        double param_scan {-1};                 // by default calibrate the scan fraction
+        if (argc == 9)
+                param_scan = stod(argv[8]);
 
-        NearNeighborSearch(data_file, query_file, param_r, param_c, param_family);
+        NearNeighborSearch(data_file, query_file, param_r, param_c, param_family, param_memory, param_recall,
+                           param_scan);
 
         return EXIT_SUCCESS;
 }
@@ -0,0 +1,482 @@
+// Deterministic LSH with an out-of-core index build for data sets larger than memory.
+//
+// The data file is streamed once to count points, and once more to pack every point
+// into a points file and emit (table, bucket, id) entries; entries are sorted in
+// memory-bounded runs which are merged into the on-disk table layout:
+//   index.meta     header and, per table, its first key
+//   index.keys     sorted distinct buckets of every table
+//   index.starts   per key, its first id (plus a sentinel)
+//   index.ids      data point indices grouped by (table, bucket)
+//   points.bin     data points packed 64 bits per word
+// Queries map these files and verify candidates against the mapped points.
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lsh_kernels.h"
+#include "projection_family.h"
+
+using namespace std;
+
+const uint64_t index_magic {0x48534c6d72657464};  // "detrmLSH"
+const int merge_block {4096};           // entries buffered per run while merging
+const size_t reserved_files {16};       // descriptors kept for the standard streams and merge outputs
+
+// one point in one hash table
+struct Entry {
+        int64_t bucket;
+        uint32_t table;
+        uint32_t id;
+};
+
+bool operator<(const Entry& a, const Entry& b) {
+        return tie(a.table, a.bucket, a.id) < tie(b.table, b.bucket, b.id);
+}
+
+// index file header, followed in index.meta by the first key of every table (plus a sentinel)
+struct IndexHeader {
+        uint64_t magic;
+        int32_t r, d, n;
+        Family f;                       // regenerates the projection at query time
+        uint64_t keys;                  // distinct buckets over all tables
+        uint64_t entries;               // n * #functions
+};
+
+void fail(const string& message) {
+        cerr << message << endl;
+        exit(EXIT_FAILURE);
+}
+
+// peak resident set size in MB
+double peakMemoryMB() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return usage.ru_maxrss / (1024.0 * 1024.0);     // bytes
+#else
+        return usage.ru_maxrss / 1024.0;                // kilobytes
+#endif
+}
+
+// read-only memory mapping of a whole file
+struct MappedFile {
+        const char* data {nullptr};
+        size_t size {0};
+
+        explicit MappedFile(const string& file, const int advice = MADV_NORMAL) {
+                int fd = open(file.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0)
+                        fail("unable to open " + file);
+                size = st.st_size;
+                if (size > 0) {
+                        void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                        if (p == MAP_FAILED)
+                                fail("unable to map " + file);
+                        madvise(p, size, advice);
+                        data = static_cast<const char*>(p);
+                }
+                close(fd);
+        }
+        ~MappedFile() {
+                if (data)
+                        munmap(const_cast<char*>(data), size);
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        template <typename T>
+        const T* as() const {
+                return reinterpret_cast<const T*>(data);
+        }
+};
+
+// write a block of bytes, failing if the write does not complete (e.g. the disk is full)
+void writeBytes(ofstream& out, const string& file, const void* data, const size_t bytes) {
+        out.write(static_cast<const char*>(data), bytes);
+        if (!out)
+                fail("unable to write " + file);
+}
+
+// flush and close a file written with writeBytes, failing if the data did not reach it
+void closeFile(ofstream& out, const string& file) {
+        out.close();
+        if (!out)
+                fail("unable to write " + file);
+}
+
+// buffered writer of fixed-size records
+template <typename T>
+struct RecordWriter {
+        string file;
+        ofstream out;
+        vector<T> buffer;
+
+        explicit RecordWriter(const string& file) : file {file}, out {file, ios::binary} {
+                if (!out.is_open())
+                        fail("unable to create " + file);
+                buffer.reserve(merge_block);
+        }
+        ~RecordWriter() {
+                if (out.is_open()) {
+                        flush();
+                        closeFile(out, file);
+                }
+        }
+        void put(const T& record) {
+                buffer.push_back(record);
+                if (buffer.size() == buffer.capacity())
+                        flush();
+        }
+        void flush() {
+                writeBytes(out, file, buffer.data(), buffer.size() * sizeof(T));
+                buffer.clear();
+        }
+};
+
+// buffered reader over a sorted run file
+struct RunReader {
+        ifstream in;
+        vector<Entry> block;
+        size_t pos {0};
+
+        explicit RunReader(const string& file) : in {file, ios::binary} {
+                if (!in.is_open())
+                        fail("unable to open " + file);
+        }
+        bool next(Entry& e) {
+                if (pos == block.size()) {
+                        block.resize(merge_block);
+                        in.read(reinterpret_cast<char*>(block.data()), merge_block * sizeof(Entry));
+                        block.resize(in.gcount() / sizeof(Entry));
+                        pos = 0;
+                        if (block.empty())
+                                return false;
+                }
+                e = block[pos++];
+                return true;
+        }
+};
+
+// runs merged at once: as many as fit their read buffers in param_memory bytes, but no more
+// than the open file limit allows, since every run being merged holds a descriptor
+size_t mergeFanIn(const size_t param_memory) {
+        size_t fan_in {param_memory / (merge_block * sizeof(Entry))};
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+                const size_t files {static_cast<size_t>(limit.rlim_cur)};
+                fan_in = min(fan_in, files - min(files, reserved_files));
+        }
+        return max(static_cast<size_t>(2), fan_in);
+}
+
+// sort the buffered entries into a new run file
+string writeRun(vector<Entry>& buffer, const string& dir, const int pass, const int run) {
+        sort(buffer.begin(), buffer.end());
+        const string file {dir + "/run." + to_string(pass) + "." + to_string(run)};
+        ofstream out {file, ios::binary};
+        if (!out.is_open())
+                fail("unable to create " + file);
+        writeBytes(out, file, buffer.data(), buffer.size() * sizeof(Entry));
+        closeFile(out, file);
+        buffer.clear();
+        return file;
+}
+
+// k-way merge of sorted run files, removing them once consumed
+void mergeRuns(const vector<string>& runs, const function<void(const Entry&)>& emit) {
+        using Head = pair<Entry, int>;
+        auto later = [](const Head& a, const Head& b) { return b.first < a.first; };
+        priority_queue<Head, vector<Head>, decltype(later)> heap(later);
+        vector<unique_ptr<RunReader>> readers;
+        for (int i {0}, sz {static_cast<int>(runs.size())}; i < sz; ++i) {
+                readers.emplace_back(new RunReader(runs[i]));
+                Entry e;
+                if (readers[i]->next(e))
+                        heap.emplace(e, i);
+        }
+        while (!heap.empty()) {
+                const Head head {heap.top()};
+                heap.pop();
+                emit(head.first);
+                Entry e;
+                if (readers[head.second]->next(e))
+                        heap.emplace(e, head.second);
+        }
+        readers.clear();
+        for (const auto& file : runs)
+                remove(file.c_str());
+}
+
+// count points in a file of bit strings, checking that all have the same dimension
+void scanPointsFile(const string& file, int& n, int& d) {
+        ifstream fin {file};
+        if (!fin.is_open())
+                fail("unable to open " + file);
+        n = 0;
+        d = -1;
+        string point_str;
+        vector<Word> point;
+        while (fin >> point_str) {
+                if (d < 0) {
+                        d = point_str.length();
+                        point.resize((d + 63) / 64);
+                }
+                if (static_cast<int>(point_str.length()) != d)
+                        fail(file + ": point " + to_string(n) + " has dimension " + to_string(point_str.length())
+                             + ", expected " + to_string(d));
+                if (!parseBits(point_str.data(), d, point.data()))
+                        fail(file + ": point " + to_string(n) + " is not a string of 0 and 1");
+                ++n;
+        }
+}
+
+// stream the data file into the on-disk index under dir, holding at most about
+// param_memory bytes of (table, bucket, id) entries in memory at a time
+void buildIndexOnDisk(const int param_c,
+                      const int param_r,
+                      const int param_family,
+                      const string& data_file,
+                      const string& dir,
+                      const size_t param_memory) {
+        using namespace std::chrono;
+        auto build_start = high_resolution_clock::now();
+        int param_n, param_d;
+        scanPointsFile(data_file, param_n, param_d);
+        assert(param_n > 0);
+        const Family f {chooseFamily(param_c, param_r, param_n, param_family)};
+        assert(f.L > 0);                                // TODO larger r requires too much memory
+        const vector<vector<int>> projection {buildProjection(f, param_d)};
+        const int functions {static_cast<int>(projection.size())};
+        vector<PackedFunction> hash_function;   // projection compiled for packed points, as in memory
+        for (const auto& p : projection)
+                hash_function.push_back(packFunction(p));
+
+        cerr << "d = " << param_d << endl
+             << "n = " << param_n << endl
+             << "family = " << f.family << endl
+             << "b = " << f.b << endl
+             << "q = " << f.q << endl
+             << "t = " << f.t << endl
+             << "r' = " << f.R << endl
+             << "L = " << f.L << endl
+             << "#functions = " << functions << endl;
+
+        // pack points and emit entries, spilling sorted runs whenever the buffer is full
+        auto spill_start = high_resolution_clock::now();
+        const size_t capacity {max(static_cast<size_t>(functions), param_memory / sizeof(Entry))};
+        vector<Entry> buffer;
+        buffer.reserve(capacity);
+        vector<string> runs;
+        {
+                RecordWriter<Word> points {dir + "/points.bin"};
+                ifstream fin {data_file};
+                string point_str;
+                vector<Word> point((param_d + 63) / 64);
+                for (uint32_t id {0}; fin >> point_str; ++id) {
+                        if (id >= static_cast<uint32_t>(param_n) || static_cast<int>(point_str.length()) != param_d
+                            || !parseBits(point_str.data(), param_d, point.data()))
+                                fail(data_file + ": point " + to_string(id) + " changed since it was counted");
+                        for (const auto& w : point)
+                                points.put(w);
+                        for (int j {0}; j < functions; ++j)
+                                buffer.push_back(Entry {packedBucketOf(hash_function[j], point.data()), static_cast<uint32_t>(j), id});
+                        if (buffer.size() + functions > capacity)
+                                runs.push_back(writeRun(buffer, dir, 0, runs.size()));
+                }
+                if (!buffer.empty())
+                        runs.push_back(writeRun(buffer, dir, 0, runs.size()));
+        }
+        vector<Entry>().swap(buffer);
+        auto spill_duration = duration_cast<milliseconds>(high_resolution_clock::now() - spill_start);
+        cerr << "Wrote " << runs.size() << " sorted runs in " << spill_duration.count() << "ms" << endl;
+
+        // merge runs in groups until they can be merged at once within the memory bound
+        auto merge_start = high_resolution_clock::now();
+        const size_t fan_in {mergeFanIn(param_memory)};
+        int pass {0};
+        while (runs.size() > fan_in) {
+                ++pass;
+                vector<string> merged;
+                for (size_t i {0}; i < runs.size(); i += fan_in) {
+                        const vector<string> group(runs.begin() + i, runs.begin() + min(runs.size(), i + fan_in));
+                        const string file {dir + "/run." + to_string(pass) + "." + to_string(merged.size())};
+                        RecordWriter<Entry> out {file};
+                        mergeRuns(group, [&out](const Entry& e) { out.put(e); });
+                        merged.push_back(file);
+                }
+                runs.swap(merged);
+        }
+
+        // final merge into the table layout
+        vector<uint64_t> table_start(functions + 1, 0);
+        uint64_t keys {0}, entries {0};
+        {
+                RecordWriter<int64_t> key_out {dir + "/index.keys"};
+                RecordWriter<uint64_t> start_out {dir + "/index.starts"};
+                RecordWriter<uint32_t> id_out {dir + "/index.ids"};
+                int64_t table {-1}, bucket {0};
+                mergeRuns(runs, [&](const Entry& e) {
+                        if (e.table != table || e.bucket != bucket) {
+                                for (; table < e.table; ++table)
+                                        table_start[table + 1] = keys;
+                                bucket = e.bucket;
+                                key_out.put(bucket);
+                                start_out.put(entries);
+                                ++keys;
+                        }
+                        id_out.put(e.id);
+                        ++entries;
+                });
+                for (; table < functions; ++table)
+                        table_start[table + 1] = keys;
+                start_out.put(entries);
+        }
+        {
+                const string file {dir + "/index.meta"};
+                ofstream meta {file, ios::binary};
+                if (!meta.is_open())
+                        fail("unable to create " + file);
+                const IndexHeader header {index_magic, param_r, param_d, param_n, f, keys, entries};
+                writeBytes(meta, file, &header, sizeof(header));
+                writeBytes(meta, file, table_start.data(), table_start.size() * sizeof(uint64_t));
+                closeFile(meta, file);
+        }
+        auto merge_duration = duration_cast<milliseconds>(high_resolution_clock::now() - merge_start);
+        cerr << "Merged in " << pass << " intermediate passes and " << merge_duration.count() << "ms" << endl;
+
+        auto build_duration = duration_cast<milliseconds>(high_resolution_clock::now() - build_start);
+        struct stat st;
+        const double data_mb {stat(data_file.c_str(), &st) == 0 ? st.st_size / (1024.0 * 1024.0) : 0};
+        const double seconds {max(build_duration.count(), static_cast<decltype(build_duration.count())>(1)) / 1000.0};
+        cerr << "Data structure built in " << build_duration.count() << "ms" << endl
+             << "Build throughput = " << param_n / seconds << " points/s, " << data_mb / seconds << " MB/s" << endl
+             << "Index: " << keys << " buckets, " << entries << " entries" << endl
+             << "Peak memory = " << peakMemoryMB() << "MB" << endl;
+}
+
+// answer r-near neighbor queries from the on-disk index under dir
+void queryIndexOnDisk(const string& dir, const string& query_file) {
+        const MappedFile meta {dir + "/index.meta"};
+        if (meta.size < sizeof(IndexHeader) || meta.as<IndexHeader>()->magic != index_magic)
+                fail(dir + "/index.meta is not an index");
+        const IndexHeader& header {*meta.as<IndexHeader>()};
+        const uint64_t* table_start {reinterpret_cast<const uint64_t*>(meta.data + sizeof(IndexHeader))};
+        const MappedFile keys {dir + "/index.keys"};
+        const MappedFile starts {dir + "/index.starts"};
+        const MappedFile ids {dir + "/index.ids", MADV_RANDOM};
+        const MappedFile points {dir + "/points.bin", MADV_RANDOM};
+        const int64_t* key {keys.as<int64_t>()};
+        const uint64_t* start {starts.as<uint64_t>()};
+        const uint32_t* id {ids.as<uint32_t>()};
+        const int param_d {header.d};
+        const int words {(param_d + 63) / 64};
+        vector<PackedFunction> hash_function;
+        for (const auto& p : buildProjection(header.f, param_d))
+                hash_function.push_back(packFunction(p));
+
+        ifstream fin {query_file};
+        if (!fin.is_open())
+                fail("unable to open " + query_file);
+
+        using namespace std::chrono;
+        auto query_start = high_resolution_clock::now();
+        string point_str;
+        vector<Word> point(words);
+        for (int i {0}; fin >> point_str; ++i) {
+                if (static_cast<int>(point_str.length()) != param_d)
+                        fail(query_file + ": point " + to_string(i) + " has dimension " + to_string(point_str.length())
+                             + ", expected " + to_string(param_d));
+                if (!parseBits(point_str.data(), param_d, point.data()))
+                        fail(query_file + ": point " + to_string(i) + " is not a string of 0 and 1");
+                unordered_set<uint32_t> candidates;
+                for (int j {0}, sz {static_cast<int>(hash_function.size())}; j < sz; ++j) {
+                        const int64_t bucket {packedBucketOf(hash_function[j], point.data())};
+                        const int64_t* found {lower_bound(key + table_start[j], key + table_start[j + 1], bucket)};
+                        if (found == key + table_start[j + 1] || *found != bucket)
+                                continue;
+                        candidates.insert(id + start[found - key], id + start[found - key + 1]);
+                }
+
+                // validate if near neighbors are within r
+                vector<uint32_t> result;
+                for (const auto& j : candidates) {
+                        if (packedDistance(point.data(), points.as<Word>() + static_cast<size_t>(j) * words, words) <= header.r)
+                                result.push_back(j);
+                }
+
+                // TODO should disable output for measuring query performance
+                cout << "Query point " << i << ": found " << result.size() << " NNs\n";
+                for (const auto& p : result) {
+                        cout << toString(unpackPoint(points.as<Word>() + static_cast<size_t>(p) * words, param_d)) << '\n';
+                }
+        }
+        auto query_end = high_resolution_clock::now();
+        auto query_duration = duration_cast<milliseconds>(query_end - query_start);
+        cerr << "Querying completed in " << query_duration.count() << "ms" << endl
+             << "Peak memory = " << peakMemoryMB() << "MB" << endl;
+}
+
+int main(int argc, char* argv[]) {
+        parseIsaFlag(argc, argv);
+        if (argc < 6 || argc > 8) {
+                cerr << "Usage: " << argv[0] << " [--isa=NAME] R C DataFile QueryFile WorkDir [Family] [MemoryMB]\n"
+                     << "       --isa=NAME      (optional) run the kernels built for NAME, one of " << supportedKernels() << "\n"
+                     << "                       by default the first one, the fastest this cpu supports\n"
+                     << "       R               retrieve all points within hamming distance R\n"
+                     << "       C               approximation factor\n"
+                     << "       DataFile        file containing all data points of the same dimension\n"
+                     << "                       each point represented as a binary string in a line\n"
+                     << "       QueryFile       file containing all query points\n"
+                     << "       WorkDir         existing directory for sorted runs and the index files\n"
+                     << "       Family          choose hamming projection family H_A1 or H_A2\n"
+                     << "                       by default, if cr<log(n) use H_A1; otherwise, use H_A2\n"
+                     << "       MemoryMB        memory for buffering index entries during the build\n"
+                     << "                       default is 256\n";
+                return EXIT_FAILURE;
+        }
+
+        const int param_r {stoi(argv[1])};
+        const int param_c {stoi(argv[2])};
+        const string data_file {argv[3]};
+        const string query_file {argv[4]};
+        const string dir {argv[5]};
+        int param_family {0};   // automatically choose projection family based on cr<>log(n)
+        if (argc >= 7)
+                param_family = stoi(argv[6]);
+        double param_memory {256};
+        if (argc == 8)
+                param_memory = stod(argv[7]);
+        assert(param_r > 0 && param_memory > 0);
+
+        cerr << "r = " << param_r << endl
+             << "c = " << param_c << endl
+             << "memory = " << param_memory << "MB" << endl
+             << "isa = " << kernels().name << endl;
+
+        buildIndexOnDisk(param_c, param_r, param_family, data_file, dir, static_cast<size_t>(param_memory * (1 << 20)));
+        queryIndexOnDisk(dir, query_file);
+
+        return EXIT_SUCCESS;
+}
@@ -1,65 +1,173 @@
 /**
  * Flann LSH
+ *
+ * Baseline r-near neighbor search in hamming space with FLANN's native
+ * Hamming LSH index or hierarchical clustering index. Points are loaded
+ * like the other drivers and handed to FLANN 8 bits per byte; recall is
+ * measured against an exact linear scan.
+ *
+ * Usage: [filename] [--isa=NAME] R data_set_file query_set_file [lsh|hierarchical] [cores]
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <string>
+#include <vector>
+
+#include <sys/resource.h>
 
 #include <flann/flann.hpp>
 
+#include "lsh_kernels.h"
+#include "point_loader.h"
+
 using namespace flann;
 using namespace std;
 
-void load_from_file(Matrix<float>& dataset, const string& filename) {
-  ifstream dfile(filename);
-  if (!dfile.is_open()) {
-    cout << "unable to open data set file: " << filename << endl;
-    exit(1);
-  }
+// LSH index parameters
+const unsigned lsh_tables = 12;
+const unsigned lsh_key_size = 20;          // capped by the number of bits per point
+const unsigned lsh_probe_level = 2;
 
-  string line;
+// leafs to visit per query in the hierarchical clustering index
+const int hierarchical_checks = 128;
 
-  int i = 0;
-  while (dfile >> line) {
-    for (unsigned j = 0; j < line.length(); j++) {
-      dataset[i][j] = line[j]-'0';
-    }
-    i++;
+// copy packed points into the rows of a byte matrix, keeping only the bytes that hold bits;
+// on little-endian machines, which the kernels assume, bit j lands in bit j % 8 of byte j / 8,
+// so hamming distances are unchanged
+Matrix<unsigned char> to_matrix(const PackedPoints& points) {
+  const size_t cols = (points.d + 7) / 8;
+  Matrix<unsigned char> matrix(new unsigned char[points.n * cols](), points.n, cols);
+  for (int i = 0; i < points.n; i++) {
+    memcpy(matrix[i], points.data.data() + static_cast<size_t>(i) * points.words, cols);
   }
+  return matrix;
+}
 
-  dfile.close();
+// peak resident set size in MB
+double peak_memory_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / (1024.0 * 1024.0);   // bytes
+#else
+  return usage.ru_maxrss / 1024.0;              // kilobytes
+#endif
 }
 
 int main(int argc, char** argv) {
-    int d = 10;
-    Matrix<float> dataset(new float[16*d], 16, d);
-    Matrix<float> query(new float[4*d], 4, d);
-    load_from_file(dataset, "data/files/d10nd16");
-    load_from_file(query, "data/files/d10nq4");
-
-    Matrix<int> indices(new int[query.rows*d], query.rows, d);
-    Matrix<float> dists(new float[query.rows*d], query.rows, d);
-
-    // construct a hierarchical clustering index
-    // default paramaters:
-    // branching factor: 32
-    // centers: random
-    // number of parallel trees: 4
-    // leaf_max_size: 100
-    Index<L2<float>> index(dataset, flann::HierarchicalClusteringIndexParams());
+    parseIsaFlag(argc, argv);
+    if (argc < 4 || argc > 6) {
+        cerr << "Usage: " << argv[0] << " [--isa=NAME] R data_set_file query_set_file [lsh|hierarchical] [cores]" << endl
+             << "       --isa=NAME      kernels of the exact scan, one of " << supportedKernels() << endl
+             << "       R               retrieve all points within hamming distance R" << endl
+             << "       lsh             FLANN hamming LSH index (default)" << endl
+             << "       hierarchical    FLANN hierarchical clustering index, "
+             << hierarchical_checks << " checks per query" << endl
+             << "       cores           search threads, 0 for all cores (default 1)" << endl;
+        exit(1);
+    }
+
+    const int R = stoi(argv[1]);
+    const string algorithm = argc >= 5 ? argv[4] : "lsh";
+    const int cores = argc == 6 ? stoi(argv[5]) : 1;
+    if (algorithm != "lsh" && algorithm != "hierarchical") {
+        cerr << "unknown index: " << algorithm << endl;
+        exit(1);
+    }
+
+    // the loader rejects lines that are not strings of 0 and 1, like in the other drivers
+    const PackedPoints datapoints = readPackedPoints(argv[2]);
+    const PackedPoints querypoints = readPackedPoints(argv[3]);
+    if (datapoints.n == 0) {
+        cerr << "empty data set file: " << argv[2] << endl;
+        exit(1);
+    }
+    if (querypoints.n > 0 && querypoints.d != datapoints.d) {
+        cerr << "query points have dimension " << querypoints.d << ", data points " << datapoints.d << endl;
+        exit(1);
+    }
+    const int d = datapoints.d;
+    Matrix<unsigned char> dataset = to_matrix(datapoints);
+    Matrix<unsigned char> query = to_matrix(querypoints);
+
+    cerr << "r = " << R << endl
+         << "d = " << d << endl
+         << "n = " << dataset.rows << endl
+         << "#query = " << query.rows << endl
+         << "index = " << algorithm << endl
+         << "isa = " << kernels().name << endl
+         << "cores = " << cores << endl;
+
+    using namespace std::chrono;
+    IndexParams index_params;
+    if (algorithm == "lsh") {
+        const unsigned key_size = min(lsh_key_size, static_cast<unsigned>(d));
+        index_params = LshIndexParams(lsh_tables, key_size, lsh_probe_level);
+        cerr << "tables = " << lsh_tables << endl
+             << "key size = " << key_size << endl
+             << "multi-probe level = " << lsh_probe_level << endl;
+    } else {
+        // default paramaters:
+        // branching factor: 32
+        // centers: random
+        // number of parallel trees: 4
+        // leaf_max_size: 100
+        index_params = HierarchicalClusteringIndexParams();
+    }
+    Index<Hamming<unsigned char>> index(dataset, index_params);
+    auto build_start = high_resolution_clock::now();
     index.buildIndex();
+    auto build_end = high_resolution_clock::now();
+    auto build_duration = duration_cast<milliseconds>(build_end - build_start);
+    cerr << "Data structure built in " << build_duration.count() << "ms" << endl;
+
+    // checks : specifies the maximum leafs to visit when searching for neigbors (ignored by lsh)
+    SearchParams search_params(hierarchical_checks);
+    search_params.cores = cores;
+    search_params.sorted = false;
+    using DistanceType = Hamming<unsigned char>::ResultType;
+    vector<vector<size_t>> indices;
+    vector<vector<DistanceType>> dists;
 
-    // do a radius search, using 128 checks
-    // checks : specifies the maximum leafs to visit when searching for neigbors
-    int n = index.radiusSearch(query, indices, dists, 3, flann::SearchParams(128));
-    cout << "number of nearest neighbors: " << n << endl;
+    // hamming distances are integral: search with radius R+1 so that points at distance R are
+    // returned whether or not the radius bound is inclusive, then drop those beyond R
+    auto query_start = high_resolution_clock::now();
+    index.radiusSearch(query, indices, dists, R + 1, search_params);
+    auto query_end = high_resolution_clock::now();
+    auto query_duration = duration_cast<milliseconds>(query_end - query_start);
+
+    size_t found = 0, exact = 0;
+    for (size_t i = 0; i < query.rows; i++) {
+        // the lsh index returns a point once for every table and probe that hits it
+        vector<size_t> result;
+        for (size_t k = 0; k < indices[i].size(); k++) {
+            if (dists[i][k] <= static_cast<DistanceType>(R)) result.push_back(indices[i][k]);
+        }
+        sort(result.begin(), result.end());
+        result.erase(unique(result.begin(), result.end()), result.end());
+        found += result.size();
+
+        cout << "Query point " << i << ": found " << result.size() << " NNs\n";
+        for (const auto& p : result) {
+            cout << toString(unpackPoint(datapoints.data.data() + p * datapoints.words, d)) << '\n';
+        }
+
+        vector<int> near;
+        scanNearNeighbors(querypoints.data.data() + i * querypoints.words, datapoints.data, datapoints.words, R, near);
+        exact += near.size();
+    }
+    cerr << "Querying completed in " << query_duration.count() << "ms" << endl
+         << "Index memory = " << index.usedMemory() / (1024.0 * 1024.0) << "MB" << endl
+         << "Peak memory = " << peak_memory_mb() << "MB" << endl
+         << "Recall = " << (exact > 0 ? static_cast<double>(found) / exact : 1.0)
+         << " (" << found << " of " << exact << " r-near neighbors)" << endl;
 
     delete[] dataset.ptr();
     delete[] query.ptr();
-    delete[] indices.ptr();
-    delete[] dists.ptr();
-    
+
     return 0;
 }
@@ -1,7 +1,7 @@
 /**
  * Exact Nearest Neigbor by linear scan.
  *
- * Usage: [filename] R data_set_file query_set_file
+ * Usage: [filename] [--isa=NAME] R data_set_file query_set_file
  */
 
 #include <chrono>
@@ -11,18 +11,12 @@
 #include <string>
 #include <vector>
 
+#include "point_loader.h"
+
 using namespace std;
 
 using HamT = vector<bool>; // binary features in hamming space
 
-HamT toHamT(const string& line) {
-        HamT ham;
-        for (unsigned i = 0; i < line.length(); i++) {
-                ham.push_back(line[i]-'0' == 1);
-        }
-        return ham;
-}
-
 const string conv_to_string(const HamT& h) {
         string s("");
 
@@ -34,58 +28,42 @@ const string conv_to_string(const HamT& h) {
         return s;
 }
 
-unsigned hamTDistance(const HamT& h1, const HamT& h2) {
-        unsigned dist = 0;
-        for (unsigned i = 0; i < h1.size(); i++) {
-                dist += static_cast<unsigned>(h1[i] != h2[i]);
-        }
-        return dist;
+const HamT point_at(const PackedPoints& points, int i) {
+        return unpackPoint(points.data.data() + static_cast<size_t>(i) * points.words, points.d);
 }
 
 int main(int argc, char** argv) {
+        parseIsaFlag(argc, argv);
         if (argc < 4) {
-                cerr << "Usage: " << argv[0] << " R data_set_file query_set_file" << endl;
+                cerr << "Usage: " << argv[0] << " [--isa=NAME] R data_set_file query_set_file" << endl
+                     << "       --isa=NAME      kernels to run, one of " << supportedKernels() << endl;
                 exit(1);
         }
 
         int R = stoi(argv[1]);
 
-        string line;
-        ifstream dataset(argv[2]);
-        if (!dataset.is_open()) {
-                cerr << "unable to open data set file: " << argv[2] << endl;
+        // points are packed 64 bits per word and scanned with popcounts
+        PackedPoints datapoints = readPackedPoints(argv[2]);
+        PackedPoints querypoints = readPackedPoints(argv[3]);
+        if (querypoints.n > 0 && querypoints.d != datapoints.d) {
+                cerr << "query points have dimension " << querypoints.d << ", data points " << datapoints.d << endl;
                 exit(1);
         }
-        vector<HamT> datapoints;
-        while (dataset >> line) {
-                datapoints.push_back(toHamT(line));
-        }
-        dataset.close();
-
-        ifstream queryset(argv[3]);
-        if (!queryset.is_open()) {
-                cerr << "unable to open query set file: " << argv[3] << endl;
-                exit(1);
-        }
-        vector<HamT> querypoints;
-        while (queryset >> line) {
-                querypoints.push_back(toHamT(line));
-        }
-        queryset.close();
+        cerr << "isa = " << kernels().name << endl;
 
         using namespace std::chrono;
         auto query_start = high_resolution_clock::now();
-        for (auto &qpoint : querypoints) {
-                int count = 0;
-                cout << "NNs (R=" << R << ") for " << conv_to_string(qpoint) << " :" << endl;
-                for (auto &dpoint : datapoints) {
-                        if (hamTDistance(qpoint, dpoint) <= static_cast<unsigned>(R)) {
-                                cout << conv_to_string(dpoint) << endl;
-                                count++;
-                        }
+        for (int q = 0; q < querypoints.n; q++) {
+                const string qstring = conv_to_string(point_at(querypoints, q));
+                vector<int> result;
+                scanNearNeighbors(querypoints.data.data() + static_cast<size_t>(q) * querypoints.words,
+                                  datapoints.data, datapoints.words, R, result);
+                cout << "NNs (R=" << R << ") for " << qstring << " :" << endl;
+                for (const int p : result) {
+                        cout << conv_to_string(point_at(datapoints, p)) << endl;
                 }
-                cout << "Total NNs for " << conv_to_string(qpoint)
-                        << " : " << count << endl;
+                cout << "Total NNs for " << qstring
+                        << " : " << result.size() << endl;
                 // cout << "Total time for R-NN query: " << endl;
         }
         auto query_end = high_resolution_clock::now();
@@ -0,0 +1,292 @@
+// The in-memory LSH index shared by the randomized and deterministic drivers: hash tables of
+// packed data points, r-near neighbor queries with the linear scan fallback, and the cost
+// measurements behind parameter tuning and the scan fraction.
+
+#ifndef LSH_INDEX_H
+#define LSH_INDEX_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "lsh_kernels.h"
+#include "point_loader.h"
+
+// LSH data structure
+struct NearNeighborIndex {
+        std::vector<std::vector<int>> projection;       // hash functions, each a list of coordinates
+        std::vector<PackedFunction> hash_function;      // projection compiled for packed points
+        std::vector<HashTable> hash_table;
+        std::vector<Word> packed_data;                  // data points packed 64 bits per word
+        int packed_words {0};                           // words per packed point
+        double scan_fraction {1};                       // scan instead of merging buckets holding more than this fraction of n
+
+        // query statistics, accumulated by getNearNeighbors
+        int64_t stat_collisions {0};                    // bucket entries found, including duplicates, by every query
+        int64_t stat_candidates {0};                    // distinct candidates checked, by queries answered from buckets
+        int64_t stat_scans {0};                         // queries answered by a linear scan
+};
+
+// hash tables probed to measure the lookup cost
+const int tune_lookup_tables {4};
+
+// keeps timed loops from being optimized away; unsigned, so sums wrap
+inline volatile uint64_t& tuneSink() {
+        static volatile uint64_t sink {0};
+        return sink;
+}
+
+inline double elapsedNs(const std::chrono::high_resolution_clock::time_point& start) {
+        using namespace std::chrono;
+        return static_cast<double>(duration_cast<nanoseconds>(high_resolution_clock::now() - start).count());
+}
+
+// compile the index's hash functions and add every data point (index) to their hash tables
+inline void addPoints(NearNeighborIndex& index) {
+        const int n {static_cast<int>(index.packed_data.size() / index.packed_words)};
+        const int functions {static_cast<int>(index.projection.size())};
+        index.hash_function.clear();
+        for (const auto& p : index.projection)
+                index.hash_function.push_back(packFunction(p));
+        index.hash_table.resize(functions);
+        for (int i {0}; i < n; ++i) {
+                const Word* point {index.packed_data.data() + static_cast<size_t>(i) * index.packed_words};
+                for (int j {0}; j < functions; ++j)
+                        index.hash_table[j][packedBucketOf(index.hash_function[j], point)].push_back(i);
+        }
+}
+
+// return all indices of near neighbors of a packed point within distance threshold r; if the
+// query's buckets hold more than scan_fraction * n entries, scan all packed data points instead
+// of merging them
+inline std::vector<int> getNearNeighbors(NearNeighborIndex& index,
+                                         const Word* point,
+                                         const int threshold,
+                                         bool& scanned) {
+        std::vector<const std::vector<int>*> buckets;
+        size_t entries {0};
+        for (int i {0}, L {static_cast<int>(index.projection.size())}; i < L; ++i) {
+                const std::vector<int>* bucket {probe(index.hash_table[i], packedBucketOf(index.hash_function[i], point))};
+                if (!bucket) {
+                        continue;
+                }
+                buckets.push_back(bucket);
+                entries += bucket->size();
+        }
+
+        index.stat_collisions += entries;
+
+        std::vector<int> result;
+        scanned = entries > index.scan_fraction * (index.packed_data.size() / index.packed_words);
+        if (scanned) {
+                ++index.stat_scans;
+                scanNearNeighbors(point, index.packed_data, index.packed_words, threshold, result);
+                return result;
+        }
+
+        std::unordered_set<int> candidates;
+        for (const auto& bucket : buckets)
+                candidates.insert(bucket->begin(), bucket->end());
+        index.stat_candidates += candidates.size();
+
+        // validate if near neighbors are within r
+        for (const auto& j : candidates) {
+                if (packedDistance(point, index.packed_data.data() + static_cast<size_t>(j) * index.packed_words,
+                                   index.packed_words) <= threshold)
+                        result.push_back(j);
+        }
+        return result;
+}
+
+// per-operation costs in nanoseconds, measured on this machine
+struct OpCosts {
+        double hash;                    // per projected coordinate of a bucket computation
+        double lookup;                  // per hash table probe
+        double collision;               // per bucket entry merged into the candidate set
+        double verify;                  // per distinct candidate checked against the query
+        double query;                   // per query, independent of the setting: candidate set, result and bucket lists
+};
+
+// estimated size in bytes of one hash table holding n indices in the given number of buckets
+inline double tableBytes(const double buckets, const int param_n) {
+        return sizeof(HashTable)
+               + buckets * (sizeof(int64_t) + sizeof(std::vector<int>) + 2 * sizeof(void*))        // node and bucket slot
+               + static_cast<double>(param_n) * sizeof(int);
+}
+
+// size in bytes of the hash tables and functions of an index
+inline double indexBytes(const NearNeighborIndex& index) {
+        double bytes {0};
+        for (const auto& table : index.hash_table) {
+                bytes += sizeof(table) + table.bucket_count() * sizeof(void*);
+                for (const auto& entry : table)
+                        bytes += sizeof(entry) + sizeof(void*) + entry.second.capacity() * sizeof(int);
+        }
+        for (const auto& p : index.projection)
+                bytes += sizeof(p) + p.capacity() * sizeof(int);
+        return bytes;
+}
+
+// time each step of a query on the packed sample, for an index of n points
+inline OpCosts measureOpCosts(const std::vector<Word>& sample,
+                              const std::vector<Word>& queries,
+                              const int words,
+                              const int param_d,
+                              const int param_n) {
+        using namespace std::chrono;
+        const int s {static_cast<int>(sample.size() / words)};
+        const int nq {static_cast<int>(queries.size() / words)};
+        const int reps {std::max(1, 1000000 / (s * param_d))};
+        uint64_t sink {0};
+        OpCosts cost;
+
+        // bucket computation over every coordinate
+        std::vector<int> coordinates(param_d);
+        std::iota(coordinates.begin(), coordinates.end(), 0);
+        const PackedFunction function {packFunction(coordinates)};
+        auto start = high_resolution_clock::now();
+        for (int rep {0}; rep < reps; ++rep) {
+                for (int i {0}; i < s; ++i)
+                        sink += packedBucketOf(function, sample.data() + static_cast<size_t>(i) * words);
+        }
+        cost.hash = elapsedNs(start) / (static_cast<double>(reps) * s * param_d);
+
+        // probing tables as large as those of the index at random keys, half of which miss, and
+        // reading the bucket found; the tables together outgrow the cache like the index does
+        std::mt19937_64 generator;
+        const int keys {std::min(param_n, 1 << 17)};
+        std::vector<HashTable> tables(tune_lookup_tables);
+        std::vector<std::pair<int, int64_t>> probe_keys;
+        for (int i {0}; i < keys; ++i) {
+                for (int t {0}; t < tune_lookup_tables; ++t) {
+                        const int64_t key {static_cast<int64_t>(generator())};
+                        tables[t][key].push_back(i);
+                        probe_keys.emplace_back(t, key);
+                        probe_keys.emplace_back(t, static_cast<int64_t>(generator()));
+                }
+        }
+        std::shuffle(probe_keys.begin(), probe_keys.end(), generator);
+        const int probes {std::min(static_cast<int>(probe_keys.size()), 1000000)};
+        start = high_resolution_clock::now();
+        for (int i {0}; i < probes; ++i) {
+                const std::vector<int>* bucket {probe(tables[probe_keys[i].first], probe_keys[i].second)};
+                if (bucket)
+                        sink += bucket->front();
+        }
+        cost.lookup = elapsedNs(start) / probes;
+
+        // merging bucket entries into the candidate set
+        std::vector<int> ids(s);
+        std::iota(ids.begin(), ids.end(), 0);
+        const int merges {std::max(1, 1000000 / s)};
+        start = high_resolution_clock::now();
+        for (int rep {0}; rep < merges; ++rep) {
+                std::unordered_set<int> candidates;
+                candidates.insert(ids.begin(), ids.end());
+                sink += candidates.size();
+        }
+        cost.collision = elapsedNs(start) / (static_cast<double>(merges) * s);
+
+        // distance checks against every sample point
+        start = high_resolution_clock::now();
+        for (int q {0}; q < nq; ++q) {
+                for (int i {0}; i < s; ++i)
+                        sink += packedDistance(queries.data() + static_cast<size_t>(q) * words,
+                                               sample.data() + static_cast<size_t>(i) * words, words);
+        }
+        cost.verify = elapsedNs(start) / (static_cast<double>(nq) * s);
+
+        // whatever a query takes beyond hashing and its candidates, from querying an index of the
+        // sample with the single function over every coordinate, whose buckets hold few points
+        NearNeighborIndex index;
+        index.projection.push_back(coordinates);
+        index.packed_data = sample;
+        index.packed_words = words;
+        index.scan_fraction = std::numeric_limits<double>::infinity();
+        addPoints(index);
+        const int runs {std::max(1, 100000 / nq)};
+        bool scanned;
+        start = high_resolution_clock::now();
+        for (int rep {0}; rep < runs; ++rep) {
+                for (int q {0}; q < nq; ++q)
+                        sink += getNearNeighbors(index, queries.data() + static_cast<size_t>(q) * words, -1, scanned).size();
+        }
+        const double queried {static_cast<double>(runs) * nq};
+        cost.query = std::max(0.0, elapsedNs(start) / queried
+                                   - (param_d * cost.hash
+                                      + index.stat_collisions / queried * cost.collision
+                                      + index.stat_candidates / queried * cost.verify));
+
+        tuneSink() = sink;
+        return cost;
+}
+
+// fraction of n above which merging bucket entries into the candidate set takes longer than
+// scanning every packed data point, from the measured per-entry and per-point costs; the
+// per-point cost of the scan is returned in scan
+inline double calibrateScanFraction(const std::vector<Word>& data, const int words, double& scan) {
+        using namespace std::chrono;
+        const int n {static_cast<int>(data.size() / words)};
+        const int points {std::min(n, 100000)};
+        const int reps {std::max(1, 1000000 / points)};
+        uint64_t sink {0};
+
+        std::vector<int> ids(points);
+        std::iota(ids.begin(), ids.end(), 0);
+        std::shuffle(ids.begin(), ids.end(), std::default_random_engine());
+        auto start = high_resolution_clock::now();
+        for (int rep {0}; rep < reps; ++rep) {
+                std::unordered_set<int> candidates;
+                candidates.insert(ids.begin(), ids.end());
+                sink += candidates.size();
+        }
+        const double merge {elapsedNs(start) / (static_cast<double>(reps) * points)};
+
+        const std::vector<Word> query(data.begin(), data.begin() + words);
+        std::vector<int> result;
+        const int scans {std::max(1, 1000000 / n)};
+        start = high_resolution_clock::now();
+        for (int rep {0}; rep < scans; ++rep) {
+                scanNearNeighbors(query.data(), data, words, -1, result);       // no point matches
+                sink += result.size();
+        }
+        scan = elapsedNs(start) / (static_cast<double>(scans) * n);
+
+        tuneSink() = sink;
+        std::cerr << "measured costs (ns): merge/entry = " << merge << ", scan/point = " << scan << std::endl;
+        return scan / merge;
+}
+
+// read points from file, where each line is a point in hamming space
+// each point is represented by a bit string of 0 and 1, deliminated by new lines
+// all points must have the same dimension, i.e. the length of the bit string
+inline PackedPoints readPointsFromFile(const std::string& file) {
+        using namespace std::chrono;
+        auto read_start = high_resolution_clock::now();
+        PackedPoints points {readPackedPoints(file)};
+        auto read_duration = duration_cast<microseconds>(high_resolution_clock::now() - read_start);
+        std::cerr << "Parsed " << points.n << " points from " << file << " in " << read_duration.count() / 1000.0
+                  << "ms (" << points.bytes / std::max(1.0, static_cast<double>(read_duration.count()))
+                  << " MB/s)" << std::endl;
+        return points;
+}
+
+// the packed points at the given indices, one after another
+inline std::vector<Word> gatherPoints(const PackedPoints& points, const std::vector<int>& ids) {
+        std::vector<Word> words;
+        words.reserve(ids.size() * points.words);
+        for (const auto& i : ids) {
+                const auto point = points.data.begin() + static_cast<size_t>(i) * points.words;
+                words.insert(words.end(), point, point + points.words);
+        }
+        return words;
+}
+
+#endif  // LSH_INDEX_H
@@ -0,0 +1,436 @@
+// Hot paths shared by the LSH binaries and the microbenchmarks: parsing points,
+// computing bucket keys, probing hash tables, checking distances and scanning
+// packed points. The kernels on packed points come in one variant per instruction
+// set; the best one supported by the CPU runs unless another is forced with --isa.
+
+#ifndef LSH_KERNELS_H
+#define LSH_KERNELS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// x86-64 variants of the packed kernels are compiled for their instruction sets with target
+// attributes and chosen at startup, so that one binary runs on every x86-64 host
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LSH_KERNEL_DISPATCH
+#include <immintrin.h>
+#endif
+
+using Point = std::vector<bool>;
+using HashTable = std::unordered_map<int64_t, std::vector<int>>;       // bucket -> indices of data points
+using Word = uint64_t;                                                  // packed points hold 64 bits per word
+
+// convert from bit vector to bit string
+inline std::string toString(const Point& point) {
+        std::string s(point.size(), '0');
+        for (int i {0}; s[i]; ++i) {
+                if (point[i])
+                        s[i] = '1';
+        }
+        return s;
+}
+
+// indices of data points in a bucket, or nullptr if the bucket is empty
+inline const std::vector<int>* probe(const HashTable& table, const int64_t bucket) {
+        auto it = table.find(bucket);
+        return it == table.end() ? nullptr : &it->second;
+}
+
+// unpack a point of dimension d
+inline Point unpackPoint(const Word* words, const int d) {
+        Point point(d);
+        for (int i {0}; i < d; ++i)
+                point[i] = (words[i >> 6] >> (i & 63)) & 1;
+        return point;
+}
+
+// pack a line of d '0'/'1' characters into words, 64 characters per word; false if any other
+// character is found
+inline bool parseBits(const char* s, const int d, Word* words) {
+        int i {0};
+#if defined(__SSE2__)
+        const __m128i zero {_mm_set1_epi8('0')}, one {_mm_set1_epi8('1')};
+        for (; i + 16 <= d; i += 16) {
+                const __m128i c {_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i))};
+                const __m128i ones {_mm_cmpeq_epi8(c, one)};
+                if (_mm_movemask_epi8(_mm_or_si128(ones, _mm_cmpeq_epi8(c, zero))) != 0xffff)
+                        return false;
+                const Word bits {static_cast<Word>(_mm_movemask_epi8(ones))};
+                if ((i & 63) == 0)
+                        words[i >> 6] = bits;
+                else
+                        words[i >> 6] |= bits << (i & 63);
+        }
+#endif
+        for (; i < d; ++i) {
+                if ((i & 63) == 0)
+                        words[i >> 6] = 0;
+                if (s[i] != '0' && s[i] != '1')
+                        return false;
+                words[i >> 6] |= static_cast<Word>(s[i] - '0') << (i & 63);
+        }
+        return true;
+}
+
+inline int popcount(Word x) {
+        x = x - ((x >> 1) & 0x5555555555555555ULL);
+        x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+        x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return static_cast<int>((x * 0x0101010101010101ULL) >> 56);
+}
+
+#if defined(__SSE2__)
+// popcount of each 64-bit lane, left in the low bits of the lane
+inline __m128i popcount2(__m128i x) {
+        const __m128i m1 {_mm_set1_epi8(0x55)}, m2 {_mm_set1_epi8(0x33)}, m4 {_mm_set1_epi8(0x0f)};
+        x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+        x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+        return _mm_sad_epu8(x, _mm_setzero_si128());    // sum the byte counts of each lane
+}
+#endif
+
+// a hash function over packed points: its distinct coordinates in increasing order, grouped by
+// the word holding them
+struct PackedFunction {
+        std::vector<int> coordinates;
+        std::vector<int> words;                 // words holding at least one coordinate
+        std::vector<Word> masks;                // the coordinates within each of those words
+        std::vector<int> shifts;                // coordinates in earlier words, modulo 64
+};
+
+// compile a hash function for packed points; repeated coordinates add nothing to a bucket
+inline PackedFunction packFunction(const std::vector<int>& function) {
+        PackedFunction packed;
+        packed.coordinates = function;
+        std::sort(packed.coordinates.begin(), packed.coordinates.end());
+        packed.coordinates.erase(std::unique(packed.coordinates.begin(), packed.coordinates.end()),
+                                 packed.coordinates.end());
+        for (int i {0}, k {static_cast<int>(packed.coordinates.size())}; i < k; ++i) {
+                const int j {packed.coordinates[i]};
+                if (packed.words.empty() || packed.words.back() != j >> 6) {
+                        packed.words.push_back(j >> 6);
+                        packed.masks.push_back(0);
+                        packed.shifts.push_back(i & 63);
+                }
+                packed.masks.back() |= Word {1} << (j & 63);
+        }
+        return packed;
+}
+
+// The kernel variants. Each computes exactly the same results:
+//   distance   hamming distance between two packed points of the given number of words
+//   scan       indices of the n packed points within distance threshold of the query, in order
+//   bucket     bucket of a packed point: bit i % 64 is the XOR of the point's bits at the
+//              function's coordinates i, i + 64, ...; points agreeing on the function's
+//              coordinates share a bucket, and with at most 64 coordinates only they do
+
+// portable variant; SSE2 is part of x86-64
+namespace isa_generic {
+
+inline int distance(const Word* a, const Word* b, const int words) {
+        int distance {0};
+        int w {0};
+#if defined(__SSE2__)
+        __m128i sum {_mm_setzero_si128()};
+        for (; w + 2 <= words; w += 2) {
+                const __m128i x {_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + w)),
+                                               _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + w)))};
+                sum = _mm_add_epi64(sum, popcount2(x));
+        }
+        distance = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+#endif
+        for (; w < words; ++w)
+                distance += popcount(a[w] ^ b[w]);
+        return distance;
+}
+
+inline void scan(const Word* query, const Word* data, const int n, const int words, const int threshold,
+                 std::vector<int>& result) {
+        int i {0};
+#if defined(__SSE2__)
+        if (words == 1) {                               // two points per vector
+                const __m128i q {_mm_set1_epi64x(static_cast<long long>(query[0]))};
+                for (; i + 2 <= n; i += 2) {
+                        const __m128i count {popcount2(_mm_xor_si128(
+                                q, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))))};
+                        if (_mm_cvtsi128_si32(count) <= threshold)
+                                result.push_back(i);
+                        if (_mm_cvtsi128_si32(_mm_unpackhi_epi64(count, count)) <= threshold)
+                                result.push_back(i + 1);
+                }
+        }
+#endif
+        for (; i < n; ++i) {
+                if (distance(query, data + static_cast<size_t>(i) * words, words) <= threshold)
+                        result.push_back(i);
+        }
+}
+
+inline int64_t bucket(const PackedFunction& function, const Word* point) {
+        Word bucket {0};
+        for (int i {0}, k {static_cast<int>(function.coordinates.size())}; i < k; ++i) {
+                const int j {function.coordinates[i]};
+                bucket ^= ((point[j >> 6] >> (j & 63)) & 1) << (i & 63);
+        }
+        return static_cast<int64_t>(bucket);
+}
+
+}  // namespace isa_generic
+
+#if defined(LSH_KERNEL_DISPATCH)
+// hardware popcount, one word at a time
+namespace isa_popcnt {
+
+__attribute__((target("popcnt")))
+inline int distance(const Word* a, const Word* b, const int words) {
+        int distance {0};
+        for (int w {0}; w < words; ++w)
+                distance += __builtin_popcountll(a[w] ^ b[w]);
+        return distance;
+}
+
+__attribute__((target("popcnt")))
+inline void scan(const Word* query, const Word* data, const int n, const int words, const int threshold,
+                 std::vector<int>& result) {
+        if (words == 1) {
+                const Word q {query[0]};
+                for (int i {0}; i < n; ++i) {
+                        if (__builtin_popcountll(q ^ data[i]) <= threshold)
+                                result.push_back(i);
+                }
+                return;
+        }
+        for (int i {0}; i < n; ++i) {
+                if (distance(query, data + static_cast<size_t>(i) * words, words) <= threshold)
+                        result.push_back(i);
+        }
+}
+
+}  // namespace isa_popcnt
+
+// byte popcounts by nibble lookup, four words per vector; bucket bits gathered with pext
+namespace isa_avx2 {
+
+// popcount of each 64-bit lane
+__attribute__((target("avx2")))
+inline __m256i popcount4(const __m256i x) {
+        const __m256i table {_mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                              0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4)};
+        const __m256i low {_mm256_set1_epi8(0x0f)};
+        const __m256i bytes {_mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, low)),
+                                             _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)))};
+        return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2,popcnt")))
+inline int distance(const Word* a, const Word* b, const int words) {
+        if (words < 8)                                  // too short to pay for the vector reduction
+                return isa_popcnt::distance(a, b, words);
+        int w {0};
+        __m256i sum {_mm256_setzero_si256()};
+        for (; w + 4 <= words; w += 4) {
+                sum = _mm256_add_epi64(sum, popcount4(_mm256_xor_si256(
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + w)),
+                        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + w)))));
+        }
+        const __m128i half {_mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1))};
+        int distance {_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half))};
+        for (; w < words; ++w)
+                distance += __builtin_popcountll(a[w] ^ b[w]);
+        return distance;
+}
+
+__attribute__((target("avx2,popcnt")))
+inline void scan(const Word* query, const Word* data, const int n, const int words, const int threshold,
+                 std::vector<int>& result) {
+        int i {0};
+        if (words == 1) {                               // four points per vector
+                const __m256i q {_mm256_set1_epi64x(static_cast<long long>(query[0]))};
+                const __m256i limit {_mm256_set1_epi64x(threshold)};
+                for (; i + 4 <= n; i += 4) {
+                        const __m256i count {popcount4(_mm256_xor_si256(
+                                q, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i))))};
+                        int near {~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(count, limit))) & 0xf};
+                        for (; near; near &= near - 1)
+                                result.push_back(i + __builtin_ctz(near));
+                }
+        }
+        for (; i < n; ++i) {
+                if (distance(query, data + static_cast<size_t>(i) * words, words) <= threshold)
+                        result.push_back(i);
+        }
+}
+
+__attribute__((target("bmi2")))
+inline int64_t bucket(const PackedFunction& function, const Word* point) {
+        Word bucket {0};
+        for (int w {0}, words {static_cast<int>(function.words.size())}; w < words; ++w) {
+                const Word bits {_pext_u64(point[function.words[w]], function.masks[w])};
+                const int shift {function.shifts[w]};
+                bucket ^= (bits << shift) | (bits >> ((64 - shift) & 63));      // rotate into place
+        }
+        return static_cast<int64_t>(bucket);
+}
+
+}  // namespace isa_avx2
+
+// native 64-bit popcounts, eight words per vector
+namespace isa_avx512 {
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+inline int distance(const Word* a, const Word* b, const int words) {
+        if (words < 8)
+                return isa_popcnt::distance(a, b, words);
+        __m512i sum {_mm512_setzero_si512()};
+        for (int w {0}; w < words; w += 8) {
+                const __mmask8 lanes {static_cast<__mmask8>(words - w >= 8 ? 0xff : (1u << (words - w)) - 1)};
+                sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_maskz_loadu_epi64(lanes, a + w),
+                                                                                  _mm512_maskz_loadu_epi64(lanes, b + w))));
+        }
+        alignas(64) int64_t lanes[8];
+        _mm512_store_si512(lanes, sum);
+        return static_cast<int>(lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+inline void scan(const Word* query, const Word* data, const int n, const int words, const int threshold,
+                 std::vector<int>& result) {
+        int i {0};
+        if (words == 1) {                               // eight points per vector
+                const __m512i q {_mm512_set1_epi64(static_cast<long long>(query[0]))};
+                const __m512i limit {_mm512_set1_epi64(threshold)};
+                for (; i + 8 <= n; i += 8) {
+                        const __m512i count {_mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(data + i)))};
+                        unsigned near {_mm512_cmple_epi64_mask(count, limit)};
+                        for (; near; near &= near - 1)
+                                result.push_back(i + __builtin_ctz(near));
+                }
+        }
+        for (; i < n; ++i) {
+                if (distance(query, data + static_cast<size_t>(i) * words, words) <= threshold)
+                        result.push_back(i);
+        }
+}
+
+}  // namespace isa_avx512
+#endif  // LSH_KERNEL_DISPATCH
+
+// one variant of the packed kernels
+struct KernelSet {
+        const char* name;
+        bool (*supported)();
+        int (*distance)(const Word*, const Word*, int);
+        void (*scan)(const Word*, const Word*, int, int, int, std::vector<int>&);
+        int64_t (*bucket)(const PackedFunction&, const Word*);
+};
+
+// all variants, fastest first
+inline const std::vector<KernelSet>& kernelSets() {
+        static const std::vector<KernelSet> sets {
+#if defined(LSH_KERNEL_DISPATCH)
+                {"avx512", []() {
+                        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")
+                               && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+                 }, isa_avx512::distance, isa_avx512::scan, isa_avx2::bucket},
+                {"avx2", []() {
+                        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")
+                               && __builtin_cpu_supports("popcnt");
+                 }, isa_avx2::distance, isa_avx2::scan, isa_avx2::bucket},
+                {"popcnt", []() {
+                        return static_cast<bool>(__builtin_cpu_supports("popcnt"));
+                 }, isa_popcnt::distance, isa_popcnt::scan, isa_generic::bucket},
+#endif
+                {"generic", []() { return true; }, isa_generic::distance, isa_generic::scan, isa_generic::bucket},
+        };
+        return sets;
+}
+
+// the variant in use, initially the fastest one the CPU supports
+inline const KernelSet*& activeKernelSet() {
+        static const KernelSet* active {[]() {
+#if defined(LSH_KERNEL_DISPATCH)
+                __builtin_cpu_init();
+#endif
+                for (const auto& set : kernelSets()) {
+                        if (set.supported())
+                                return &set;
+                }
+                return &kernelSets().back();
+        }()};
+        return active;
+}
+
+inline const KernelSet& kernels() {
+        return *activeKernelSet();
+}
+
+// use the named variant; false if it is unknown or not supported by the CPU
+inline bool selectKernels(const std::string& name) {
+        for (const auto& set : kernelSets()) {
+                if (name == set.name && set.supported()) {
+                        activeKernelSet() = &set;
+                        return true;
+                }
+        }
+        return false;
+}
+
+// names of the variants the CPU supports, fastest first
+inline std::string supportedKernels() {
+        std::string names;
+        for (const auto& set : kernelSets()) {
+                if (set.supported())
+                        names += (names.empty() ? "" : " ") + std::string(set.name);
+        }
+        return names;
+}
+
+// apply and remove a --isa=NAME argument, exiting if the variant cannot run here
+inline void parseIsaFlag(int& argc, char* argv[]) {
+        const std::string flag {"--isa="};
+        int kept {1};
+        for (int i {1}; i < argc; ++i) {
+                const std::string arg {argv[i]};
+                if (arg.compare(0, flag.size(), flag) != 0) {
+                        argv[kept++] = argv[i];
+                        continue;
+                }
+                if (!selectKernels(arg.substr(flag.size()))) {
+                        std::cerr << "isa " << arg.substr(flag.size()) << " is unknown or not supported by this cpu"
+                                  << " (supported: " << supportedKernels() << ")" << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+        }
+        argc = kept;
+}
+
+// hamming distance between two packed points
+inline int packedDistance(const Word* a, const Word* b, const int words) {
+        return kernels().distance(a, b, words);
+}
+
+// bucket of a packed point under a compiled hash function
+inline int64_t packedBucketOf(const PackedFunction& function, const Word* point) {
+        return kernels().bucket(function, point);
+}
+
+// indices of all packed data points within distance threshold of the query, in order
+inline void scanNearNeighbors(const Word* query,
+                              const std::vector<Word>& data,
+                              const int words,
+                              const int threshold,
+                              std::vector<int>& result) {
+        kernels().scan(query, data.data(), static_cast<int>(data.size() / words), words, threshold, result);
+}
+
+#endif  // LSH_KERNELS_H
@@ -0,0 +1,379 @@
+// Microbenchmarks for the LSH hot paths in lsh_kernels.h: parsing bit strings, bucket keys of
+// the covering (deterministic) and bit-sampling (randomized) families, hash table probes,
+// merging buckets into the candidate set, distance checks and linear scans of packed points. Each kernel is swept over
+// dimension, data size or bucket size and reported in nanoseconds per operation, optionally
+// with hardware counters per operation; results can be saved as a baseline and compared
+// against later to catch regressions. The packed kernels run in the variant for the best
+// instruction set of the CPU, or the one forced with --isa, and the variant is reported.
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "lsh_kernels.h"
+
+using namespace std;
+
+const vector<int> sweep_d {64, 256, 1024};             // point dimensions
+const vector<int> sweep_n {1000, 100000, 1000000};     // hash table sizes and scanned points
+const vector<int> sweep_bucket {1, 16, 256};           // bucket sizes merged into the candidate set
+const vector<int> sweep_k {16, 32, 63};                // bits sampled by the randomized family
+const int points_per_run {1000};                        // points generated per parsing/hashing/distance run
+const double min_run_ms {20};                           // each repetition runs at least this long
+const int repetitions {5};                              // best repetition is reported
+
+volatile uint64_t bench_sink;                           // keeps timed loops from being optimized away; unsigned, so sums wrap
+
+// hardware counters of the calling thread, if perf_event_open is permitted
+struct PerfCounters {
+        static const int count {3};
+        int fd[count] {-1, -1, -1};
+        bool enabled {false};
+
+        void open() {
+#ifdef __linux__
+                const uint64_t config[count] {PERF_COUNT_HW_CPU_CYCLES,
+                                              PERF_COUNT_HW_CACHE_MISSES,
+                                              PERF_COUNT_HW_BRANCH_MISSES};
+                for (int i {0}; i < count; ++i) {
+                        perf_event_attr attr;
+                        memset(&attr, 0, sizeof(attr));
+                        attr.size = sizeof(attr);
+                        attr.type = PERF_TYPE_HARDWARE;
+                        attr.config = config[i];
+                        attr.disabled = 1;
+                        attr.exclude_kernel = 1;
+                        attr.exclude_hv = 1;
+                        fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+                        if (fd[i] < 0) {
+                                close();
+                                cerr << "hardware counters unavailable: " << strerror(errno) << endl;
+                                return;
+                        }
+                }
+                enabled = true;
+#else
+                cerr << "hardware counters unavailable on this platform" << endl;
+#endif
+        }
+        void close() {
+                for (auto& f : fd) {
+                        if (f >= 0)
+                                ::close(f);
+                        f = -1;
+                }
+                enabled = false;
+        }
+        void start() {
+#ifdef __linux__
+                for (const auto& f : fd) {
+                        ioctl(f, PERF_EVENT_IOC_RESET, 0);
+                        ioctl(f, PERF_EVENT_IOC_ENABLE, 0);
+                }
+#endif
+        }
+        void stop(double value[count]) {
+#ifdef __linux__
+                for (int i {0}; i < count; ++i) {
+                        ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+                        uint64_t v {0};
+                        value[i] = read(fd[i], &v, sizeof(v)) == sizeof(v) ? static_cast<double>(v) : -1;
+                }
+#endif
+        }
+} counters;
+
+// per-operation cost of one benchmark
+struct Result {
+        string name;
+        double ns;
+        double counter[PerfCounters::count];    // cycles, cache misses, branch misses; -1 if not sampled
+};
+
+// time run(), which performs ops operations per call, and keep the fastest repetition
+Result measure(const string& name, const int64_t ops, const function<void()>& run) {
+        using namespace std::chrono;
+        Result result {name, 0, {-1, -1, -1}};
+
+        // calibrate the number of calls per repetition
+        int calls {1};
+        for (;;) {
+                auto start = high_resolution_clock::now();
+                for (int i {0}; i < calls; ++i)
+                        run();
+                if (duration_cast<microseconds>(high_resolution_clock::now() - start).count() >= min_run_ms * 1000)
+                        break;
+                calls *= 2;
+        }
+
+        for (int rep {0}; rep < repetitions; ++rep) {
+                double value[PerfCounters::count];
+                if (counters.enabled)
+                        counters.start();
+                auto start = high_resolution_clock::now();
+                for (int i {0}; i < calls; ++i)
+                        run();
+                auto end = high_resolution_clock::now();
+                if (counters.enabled)
+                        counters.stop(value);
+                const double total {static_cast<double>(ops) * calls};
+                const double ns {duration_cast<nanoseconds>(end - start).count() / total};
+                if (rep == 0 || ns < result.ns) {
+                        result.ns = ns;
+                        for (int i {0}; i < PerfCounters::count; ++i)
+                                result.counter[i] = counters.enabled && value[i] >= 0 ? value[i] / total : -1;
+                }
+        }
+        return result;
+}
+
+vector<string> randomBitStrings(const int count, const int d, default_random_engine& generator) {
+        auto coin = bind(uniform_int_distribution<int>(0, 1), ref(generator));
+        vector<string> strings(count, string(d, '0'));
+        for (auto& s : strings) {
+                for (auto& c : s)
+                        c = '0' + coin();
+        }
+        return strings;
+}
+
+// random points of dimension d, packed back to back
+vector<Word> randomPoints(const int count, const int d, default_random_engine& generator) {
+        const int words {(d + 63) / 64};
+        vector<Word> packed(static_cast<size_t>(count) * words);
+        const vector<string> strings {randomBitStrings(count, d, generator)};
+        for (int i {0}; i < count; ++i)
+                parseBits(strings[i].data(), d, packed.data() + static_cast<size_t>(i) * words);
+        return packed;
+}
+
+vector<Result> runBenchmarks() {
+        vector<Result> results;
+        default_random_engine generator;
+        auto report = [&results](const Result& r) {
+                cout << left << setw(28) << r.name << right << fixed << setprecision(2) << setw(12) << r.ns;
+                for (const auto& c : r.counter) {
+                        if (c >= 0)
+                                cout << setw(16) << c;
+                        else
+                                cout << setw(16) << "-";
+                }
+                cout << endl;
+                results.push_back(r);
+        };
+        cout << "isa = " << kernels().name << endl;
+        cout << left << setw(28) << "benchmark" << right << setw(12) << "ns/op"
+             << setw(16) << "cycles/op" << setw(16) << "cache-miss/op" << setw(16) << "branch-miss/op" << endl;
+
+        for (const auto& d : sweep_d) {
+                // parsing one bit string into a point
+                const vector<string> strings {randomBitStrings(points_per_run, d, generator)};
+                report(measure("parseBits/d=" + to_string(d), strings.size(), [&strings, d]() {
+                        vector<Word> words((d + 63) / 64);
+                        for (const auto& s : strings)
+                                bench_sink = bench_sink + parseBits(s.data(), d, words.data()) + words[0];
+                }));
+
+                const int words {(d + 63) / 64};
+                const vector<Word> packed {randomPoints(points_per_run, d, generator)};
+
+                // covering family: a function keeps each coordinate with probability 1/2, in order
+                vector<int> covering;
+                auto coin = bind(uniform_int_distribution<int>(0, 1), ref(generator));
+                for (int i {0}; i < d; ++i) {
+                        if (coin())
+                                covering.push_back(i);
+                }
+                const PackedFunction packed_covering {packFunction(covering)};
+                report(measure("bucket/packed/covering/d=" + to_string(d), points_per_run,
+                               [&packed, &packed_covering, words]() {
+                        for (size_t i {0}; i < packed.size(); i += words)
+                                bench_sink = bench_sink + packedBucketOf(packed_covering, packed.data() + i);
+                }));
+
+                // bit-sampling family: k coordinates drawn with replacement
+                for (const auto& k : sweep_k) {
+                        vector<int> sampling(k);
+                        auto coordinate = bind(uniform_int_distribution<int>(0, d - 1), ref(generator));
+                        for (auto& j : sampling)
+                                j = coordinate();
+                        const PackedFunction packed_sampling {packFunction(sampling)};
+                        report(measure("bucket/packed/sampling/d=" + to_string(d) + "/k=" + to_string(k), points_per_run,
+                                       [&packed, &packed_sampling, words]() {
+                                for (size_t i {0}; i < packed.size(); i += words)
+                                        bench_sink = bench_sink + packedBucketOf(packed_sampling, packed.data() + i);
+                        }));
+                }
+
+                // distance checks of consecutive pairs
+                report(measure("distance/packed/d=" + to_string(d), points_per_run - 1, [&packed, words]() {
+                        for (size_t i {static_cast<size_t>(words)}; i < packed.size(); i += words)
+                                bench_sink = bench_sink + packedDistance(packed.data() + i - words, packed.data() + i, words);
+                }));
+        }
+
+        // scanning n packed points for those within distance d/4 of a query
+        for (const auto& d : sweep_d) {
+                for (const auto& n : sweep_n) {
+                        const int words {(d + 63) / 64};
+                        auto word = bind(uniform_int_distribution<Word>(), ref(generator));
+                        vector<Word> packed(static_cast<size_t>(n) * words);
+                        for (auto& w : packed)
+                                w = word();
+                        const vector<Word> query(packed.begin(), packed.begin() + words);
+                        report(measure("scan/d=" + to_string(d) + "/n=" + to_string(n), n, [&packed, &query, words, d]() {
+                                vector<int> result;
+                                scanNearNeighbors(query.data(), packed, words, d / 4, result);
+                                bench_sink = bench_sink + result.size();
+                        }));
+                }
+        }
+
+        // probing tables of n buckets, half of the probes miss
+        for (const auto& n : sweep_n) {
+                HashTable table;
+                auto key = bind(uniform_int_distribution<int64_t>(0, INT64_MAX), ref(generator));
+                vector<int64_t> probes;
+                for (int i {0}; i < n; ++i) {
+                        const int64_t bucket {key()};
+                        table[bucket].push_back(i);
+                        probes.push_back(i % 2 ? bucket : key());
+                }
+                shuffle(probes.begin(), probes.end(), generator);
+                probes.resize(min(n, 100000));
+                report(measure("probe/n=" + to_string(n), probes.size(), [&table, &probes]() {
+                        for (const auto& bucket : probes) {
+                                const vector<int>* ids {probe(table, bucket)};
+                                if (ids)
+                                        bench_sink = bench_sink + ids->size();
+                        }
+                }));
+        }
+
+        // merging 64 buckets into the candidate set, ids drawn from 100000 data points
+        for (const auto& size : sweep_bucket) {
+                vector<vector<int>> buckets(64, vector<int>(size));
+                auto id = bind(uniform_int_distribution<int>(0, 100000 - 1), ref(generator));
+                for (auto& bucket : buckets) {
+                        for (auto& i : bucket)
+                                i = id();
+                }
+                report(measure("dedup/bucket=" + to_string(size), buckets.size() * size, [&buckets]() {
+                        unordered_set<int> candidates;
+                        for (const auto& bucket : buckets)
+                                candidates.insert(bucket.begin(), bucket.end());
+                        bench_sink = bench_sink + candidates.size();
+                }));
+        }
+        return results;
+}
+
+void saveBaseline(const string& file, const vector<Result>& results) {
+        ofstream fout {file};
+        if (!fout.is_open()) {
+                cerr << "unable to create baseline file: " << file << endl;
+                exit(EXIT_FAILURE);
+        }
+        fout << "isa " << kernels().name << '\n';
+        for (const auto& r : results)
+                fout << r.name << ' ' << setprecision(6) << r.ns << '\n';
+        cerr << "Saved " << results.size() << " results to " << file << endl;
+}
+
+// compare against a saved baseline, returning the number of regressions beyond the tolerance
+int compareBaseline(const string& file, const vector<Result>& results, const double tolerance) {
+        ifstream fin {file};
+        if (!fin.is_open()) {
+                cerr << "unable to open baseline file: " << file << endl;
+                exit(EXIT_FAILURE);
+        }
+        map<string, double> baseline;
+        string name, isa;
+        double ns;
+        while (fin >> name) {
+                if (name == "isa") {
+                        fin >> isa;
+                        continue;
+                }
+                if (!(fin >> ns))
+                        break;
+                baseline[name] = ns;
+        }
+        if (!isa.empty() && isa != kernels().name)
+                cerr << "baseline " << file << " ran the " << isa << " kernels, now running " << kernels().name << endl;
+
+        int regressions {0};
+        cout << endl << left << setw(28) << "benchmark" << right << setw(12) << "baseline"
+             << setw(12) << "current" << setw(10) << "ratio" << endl;
+        for (const auto& r : results) {
+                auto it = baseline.find(r.name);
+                if (it == baseline.end())
+                        continue;
+                const double ratio {r.ns / it->second};
+                const bool regressed {ratio > 1 + tolerance};
+                regressions += regressed;
+                cout << left << setw(28) << r.name << right << fixed << setprecision(2)
+                     << setw(12) << it->second << setw(12) << r.ns << setw(10) << ratio
+                     << (regressed ? "  REGRESSION" : "") << endl;
+        }
+        cerr << regressions << " regressions beyond " << tolerance * 100 << "% of " << file << endl;
+        return regressions;
+}
+
+int main(int argc, char* argv[]) {
+        bool use_counters {false};
+        string save_file, baseline_file;
+        double tolerance {0.1};
+        parseIsaFlag(argc, argv);
+        int opt;
+        while ((opt = getopt(argc, argv, "cs:b:t:")) != -1) {
+                switch (opt) {
+                        case 'c': use_counters = true; break;
+                        case 's': save_file = optarg; break;
+                        case 'b': baseline_file = optarg; break;
+                        case 't': tolerance = stod(optarg); break;
+                        default: {
+                                cerr << "Usage: " << argv[0] << " [--isa=NAME] [-c] [-s SaveFile] [-b BaselineFile] [-t Tolerance]\n"
+                                     << "       --isa=NAME      run the packed kernels built for NAME, one of " << supportedKernels() << "\n"
+                                     << "                       by default the first one, the fastest this cpu supports\n"
+                                     << "       -c              sample cycles, cache misses and branch misses per operation\n"
+                                     << "       -s SaveFile     save ns/op of every benchmark as a baseline\n"
+                                     << "       -b BaselineFile compare against a saved baseline, failing on regressions\n"
+                                     << "       -t Tolerance    allowed slowdown before a regression is reported\n"
+                                     << "                       default tolerance is 0.1 (10%)\n";
+                                return EXIT_FAILURE;
+                        }
+                }
+        }
+
+        if (use_counters)
+                counters.open();
+        const vector<Result> results {runBenchmarks()};
+        counters.close();
+
+        if (!save_file.empty())
+                saveBaseline(save_file, results);
+        if (!baseline_file.empty() && compareBaseline(baseline_file, results, tolerance) > 0)
+                return EXIT_FAILURE;
+
+        return EXIT_SUCCESS;
+}
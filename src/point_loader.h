@@ -0,0 +1,162 @@
+// Parallel loader for files of points in hamming space, one bit string of '0' and '1' per
+// line. The file is memory mapped and split into line-aligned chunks; each thread counts
+// the lines of its chunk, then packs them with parseBits into its slice of the result.
+// Lines may end in "\n" or "\r\n", blank lines are skipped, and every point must have the
+// dimension of the first one.
+
+#ifndef POINT_LOADER_H
+#define POINT_LOADER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lsh_kernels.h"
+
+// points packed 64 bits per word, back to back
+struct PackedPoints {
+        int n {0};
+        int d {0};
+        int words {0};                  // words per point
+        std::vector<Word> data;         // n * words
+        size_t bytes {0};               // size of the text file
+};
+
+// one line-aligned chunk of the file
+struct PointChunk {
+        const char* begin;
+        const char* end;
+        int64_t lines {0};
+        int64_t points {0};             // non-blank lines
+        int64_t first {0};              // index of the chunk's first point
+        int64_t bad_line {-1};          // line within the chunk of the first malformed point
+};
+
+// next line in [s, end), without its "\n" or "\r\n"; returns the start of the line after
+inline const char* nextLine(const char* s, const char* end, const char*& line, int& length) {
+        const char* newline {static_cast<const char*>(memchr(s, '\n', end - s))};
+        const char* next {newline ? newline + 1 : end};
+        const char* stop {newline ? newline : end};
+        if (stop > s && stop[-1] == '\r')
+                --stop;
+        line = s;
+        length = static_cast<int>(stop - s);
+        return next;
+}
+
+// read points from a file of bit strings, using the given number of threads
+inline PackedPoints readPackedPoints(const std::string& file,
+                                     unsigned threads = std::thread::hardware_concurrency()) {
+        PackedPoints points;
+        const int fd {open(file.c_str(), O_RDONLY)};
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+                std::cerr << "unable to open points file: " << file << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        const size_t size {static_cast<size_t>(st.st_size)};
+        points.bytes = size;
+        if (size == 0) {
+                close(fd);
+                return points;
+        }
+        void* mapped {mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+        close(fd);
+        if (mapped == MAP_FAILED) {
+                std::cerr << "unable to map points file: " << file << std::endl;
+                exit(EXIT_FAILURE);
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        const char* text {static_cast<const char*>(mapped)};
+        const char* end {text + size};
+
+        // the dimension is the length of the first non-blank line
+        const char* line;
+        for (const char* s {text}; s < end && points.d == 0;)
+                s = nextLine(s, end, line, points.d);
+        points.words = (points.d + 63) / 64;
+
+        // split into chunks of about equal size, each ending after a newline
+        threads = std::max(1u, std::min(threads, static_cast<unsigned>(size / (1 << 16) + 1)));
+        std::vector<PointChunk> chunks;
+        for (const char* s {text}; s < end;) {
+                const char* stop {std::min(end, s + (size + threads - 1) / threads)};
+                const char* newline {stop < end ? static_cast<const char*>(memchr(stop, '\n', end - stop)) : nullptr};
+                stop = newline ? newline + 1 : end;
+                PointChunk chunk;
+                chunk.begin = s;
+                chunk.end = stop;
+                chunks.push_back(chunk);
+                s = stop;
+        }
+
+        // run work on every chunk, one thread per chunk
+        auto parallel = [&chunks](const std::function<void(PointChunk&)>& work) {
+                std::vector<std::thread> workers;
+                for (size_t i {1}; i < chunks.size(); ++i)
+                        workers.emplace_back(work, std::ref(chunks[i]));
+                work(chunks[0]);
+                for (auto& worker : workers)
+                        worker.join();
+        };
+
+        // count lines and points per chunk, then give each chunk its slice of the output
+        parallel([](PointChunk& chunk) {
+                const char* line;
+                int length;
+                for (const char* s {chunk.begin}; s < chunk.end; ++chunk.lines) {
+                        s = nextLine(s, chunk.end, line, length);
+                        chunk.points += length > 0;
+                }
+        });
+        int64_t n {0};
+        for (auto& chunk : chunks) {
+                chunk.first = n;
+                n += chunk.points;
+        }
+        points.n = static_cast<int>(n);
+        points.data.resize(static_cast<size_t>(n) * points.words);
+
+        // pack the points of every chunk, noting the first malformed line
+        parallel([&points](PointChunk& chunk) {
+                Word* out {points.data.data() + chunk.first * points.words};
+                const char* line;
+                int length;
+                int64_t i {0};
+                for (const char* s {chunk.begin}; s < chunk.end; ++i) {
+                        s = nextLine(s, chunk.end, line, length);
+                        if (length == 0)
+                                continue;
+                        if (length != points.d || !parseBits(line, length, out)) {
+                                chunk.bad_line = i;
+                                return;
+                        }
+                        out += points.words;
+                }
+        });
+
+        int64_t lines {0};
+        for (const auto& chunk : chunks) {
+                if (chunk.bad_line >= 0) {
+                        std::cerr << file << ": line " << lines + chunk.bad_line + 1
+                                  << " is not a bit string of dimension " << points.d << std::endl;
+                        exit(EXIT_FAILURE);
+                }
+                lines += chunk.lines;
+        }
+        munmap(mapped, size);
+        return points;
+}
+
+#endif  // POINT_LOADER_H
@@ -0,0 +1,113 @@
+// The hamming projection families H_A1 and H_A2 of the deterministic (covering) LSH scheme,
+// shared by the in-memory and out-of-core drivers. An index built by one must regenerate the
+// same hash functions when it is queried, so they are defined once, here.
+
+#ifndef PROJECTION_FAMILY_H
+#define PROJECTION_FAMILY_H
+
+#include <cassert>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+// parameters of the hamming projection family
+struct Family {
+        int family;
+        int b, q, t;
+        int R;                  // parameter r'
+        int L;                  // hash functions for every partition
+};
+
+const int max_family_exponent {30};     // bound on tr'+1, so that L = 2^(tr'+1)-1 fits in an int
+
+// derive r' and L from the partitioning (b, q) and the number of combined functions t;
+// L is 0 if tr'+1 reaches max_family_exponent
+inline Family makeFamily(const int family,
+                         const int param_r,
+                         const int param_b,
+                         const int param_q,
+                         const int param_t) {
+        const int param_R = static_cast<int>(std::floor(param_r * param_q / param_b));  // parameter r'
+        const int exponent = param_t * param_R + 1;
+        const int param_L = exponent < max_family_exponent ? (1 << exponent) - 1 : 0;     // use L = 2^(tr'+1)-1 hash functions for every partition
+                                                                                            // b*L hash functions in total
+        return Family {family, param_b, param_q, param_t, param_R, param_L};
+}
+
+// compute LSH parameters
+inline Family chooseFamily(const int param_c,
+                           const int param_r,
+                           const int param_n,
+                           const int param_family) {
+        int family = param_family;
+        if (family != 1 && family != 2) {
+                        if (param_r > static_cast<int>(std::ceil(static_cast<double>(param_n)) / param_c))
+                                family = 2;
+                else
+                        family = 1;
+        }
+        switch (family) {
+                case 1: {
+                        return makeFamily(family, param_r, 1, 1,
+                                          static_cast<int>(std::ceil(std::log2(static_cast<double>(param_n)) / param_c / param_r)));
+                }
+                case 2: {
+                        return makeFamily(family, param_r, param_r,
+                                          2 * static_cast<int>(std::ceil(std::log(static_cast<double>(param_n)) / param_c)), 1);
+                }
+                default: {
+                        assert(false);  // only two available parameter settings for projection family
+                        return Family {};
+                }
+        }
+}
+
+// generate the b*L hash functions of a hamming projection family, each a list of coordinates
+inline std::vector<std::vector<int>> buildProjection(const Family& f, const int param_d) {
+        const int param_b {f.b}, param_q {f.q}, param_t {f.t}, param_L {f.L};
+        std::vector<std::vector<int>> projection;
+
+        // initialize hamming projection family
+        std::default_random_engine generator;
+        std::vector<int> p_start;       // random intervals function
+        auto die = std::bind(std::uniform_int_distribution<int>(1, param_b), generator);
+        for (int i {1}; i <= param_d; ++i) {
+                p_start.push_back(die());
+        }
+        projection.resize(param_b * param_L);
+        auto dice = std::bind(std::uniform_int_distribution<int>(0, param_L), generator);
+        // for each i, check if a(v,k)_i = 1, if yes, then add (i-1) to projection[(k-1)*L + (v-1)]
+        for (int i {1}; i <= param_d; ++i) {
+                for (int k {1}; k <= param_b; ++k) {
+                        // compute p^-1(k)_i, if 0, then check next k
+                        // essentially check whether k is in the wrap-around q-length interval starting from p_start[i-1]
+                        if (!((p_start[i - 1] <= k && k < p_start[i - 1] + param_q) ||
+                              (p_start[i - 1] > k && k + param_b < p_start[i - 1] + param_q)))
+                                continue;
+                        // use all v in {0,1}^(tr'+1)\{0}
+                        for (int v = 1; v <= param_L; ++v) {
+                                bool result_one = false;
+                                for (int j {0}; j < param_t; ++j) {
+                                        int m = dice();
+                                        int p = (m & v);        // bitwise conjunction
+                                        bool w = false;         // compute parity
+                                        while (p) {
+                                                p &= (p - 1);
+                                                w = !w;
+                                        }
+                                        if (w) {                // shortcut for disjunction
+                                                result_one =  true;
+                                                break;
+                                        }
+                                }
+                                if (result_one) {
+                                        projection[(k - 1) * param_L + (v - 1)].push_back(i - 1);
+                                }
+                        }
+                }
+        }
+        return projection;
+}
+
+#endif  // PROJECTION_FAMILY_H
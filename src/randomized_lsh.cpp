@@ -7,128 +7,155 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <numeric>
 #include <random>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
-using namespace std;
+#include "lsh_kernels.h"
+#include "lsh_index.h"
+#include "point_loader.h"
 
-using Point = vector<bool>;
+using namespace std;
 
-// LSH data structure
-vector<vector<int>> projection;         // random projection family
-vector<unordered_map<int64_t, vector<int>>> hash_table;
+NearNeighborIndex lsh;                  // LSH data structure
 
-// build LSH constructions from input data points
-void buildNearNeighborStruct(const int param_c,
-                             const int param_r,
-                             const int param_d,
-                             const int param_n,
-                             const double param_delta,
-                             const vector<Point>& data) {
-        // compute LSH parameters: randomly select k bits; use L hash tables
+// compute LSH parameters: randomly select k bits; use L hash tables
+void chooseParams(const int param_c,
+                  const int param_r,
+                  const int param_d,
+                  const int param_n,
+                  const double param_delta,
+                  int& param_k,
+                  int& param_L) {
         // P2^k = 1/n, where P2 = 1-cr/d
         // k = -log(n) / log(P2)
-        // TODO set k to minimize expected query running time?
-        int param_k = static_cast<int>(ceil(-log(param_n) / log(1-static_cast<double>(param_c)*param_r/param_d)));
+        param_k = static_cast<int>(ceil(-log(param_n) / log(1-static_cast<double>(param_c)*param_r/param_d)));
         assert(param_k > 0 && param_k < 64);    // guarantee that bucket is within int64_t, or perhaps 32-bit is enough for now?
                                                 // for n=1M, r=d/4 and c=2, k is 20
                                                 // TODO make it more flexible for larger #buckets
         // 1 - (1-P1^k)^L >= 1 - delta, where P1 = 1-r/d
         // L >= log(delta) / log(1 - P1^k)
         // if no delta, a reasonable setting is L = n^\pho = n^(1/c)
-        int param_L = static_cast<int>(ceil(log(param_delta) / log(1 - pow(1-static_cast<double>(param_r)/param_d, param_k))));
+        param_L = static_cast<int>(ceil(log(param_delta) / log(1 - pow(1-static_cast<double>(param_r)/param_d, param_k))));
         assert(param_L > 0);
+}
+
+// build LSH constructions from input data points
+void buildNearNeighborStruct(const int param_k,
+                             const int param_L,
+                             const int param_d) {
         cerr << "k = " << param_k << endl
              << "L = " << param_L << endl;
 
         // initialize hamming projection family
-        projection.resize(param_L);
+        lsh.projection.resize(param_L);
         auto dice = bind(uniform_int_distribution<int>(0, param_d - 1), default_random_engine());
         for (int i {0}; i < param_L; ++i) {
                 for (int j {0}; j < param_k; ++j) {
-                        projection[i].push_back(dice());
+                        lsh.projection[i].push_back(dice());
                 }
         }
 
         // add data points (indices) to hash tables
-        hash_table.resize(param_L);
-        for (int i {0}; i < param_n; ++i) {
-                for (int j {0}; j < param_L; ++j) {
-                        int64_t bucket {0};
-                        for (int k {0}; k < param_k; ++k) {     // AND concatenation of k primitive functions
-                                bucket = bucket * 2 + data[i][projection[j][k]];
-                        }
-                        if (hash_table[j].find(bucket) == hash_table[j].end()) {
-                                hash_table[j].emplace(bucket, vector<int>());
-                        }
-                        hash_table[j][bucket].push_back(i);
-                }
-        }
+        addPoints(lsh);
 }
 
-// return all indices of near neighbors within distance threshold r
-vector<int> getNearNeighbors(const Point& point,
-                             const int threshold,
-                             const vector<Point>& data) {
-        unordered_set<int> candidates;
-        for (int i {0}, L {static_cast<int>(projection.size())}; i < L; ++i) {
-                int64_t bucket {0};
-                for (const auto& j : projection[i]) {
-                        bucket = bucket * 2 + point[j];
-                }
-                if (hash_table[i].find(bucket) == hash_table[i].end()) {
-                        continue;
-                }
-                candidates.insert(hash_table[i][bucket].begin(), hash_table[i][bucket].end());
-        }
+// auto-tuning: sample sizes used to measure bucket sizes and operation costs
+const int tune_sample_data {2000};
+const int tune_sample_query {200};
+const int tune_sample_functions {16};   // hash functions drawn per candidate setting
 
-        // validate if near neighbors are within r
-        vector<int> result;
-        for (const auto& j : candidates) {
-                int distance {0};
-                for (int i {0}, d {static_cast<int>(point.size())}; i < d; ++i)
-                        distance += (point[i] != data[j][i]);
-                if (distance <= threshold)
-                        result.push_back(j);
-        }
-        return result;
-}
+// predicted cost of one LSH setting
+struct TuneEstimate {
+        int k, L;
+        double recall;                  // probability that an r-near neighbor is returned
+        double memory;                  // index size in bytes
+        double collisions;              // bucket entries visited per query
+        double candidates;              // distinct candidates per query
+        double time;                    // nanoseconds per query
+};
 
-// convert from bit string to bit vector
-Point toPoint(const string& s) {
-        vector<bool> point(s.length());
-        for (int i {0}; s[i]; ++i) {
-                point[i] = s[i] - '0';
-        }
-        return point;
-}
+// pick k and L minimizing the predicted query time subject to the success probability
+// 1-delta and an index memory budget; bucket sizes are measured by hashing a sample of
+// the data and queries with random functions of each candidate k; a setting whose buckets
+// exceed the scan fraction is predicted to cost a linear scan at scan_cost per data point
+TuneEstimate autoTuneParams(const int param_r,
+                            const int param_d,
+                            const double param_delta,
+                            const double param_memory,
+                            const double scan_cost,
+                            const PackedPoints& data,
+                            const PackedPoints& query) {
+        const int param_n {data.n};
+        default_random_engine generator;
+        vector<int> order(param_n);
+        iota(order.begin(), order.end(), 0);
+        shuffle(order.begin(), order.end(), generator);
+        const int words {data.words};
+        const vector<int> ids(order.begin(), order.begin() + min(param_n, tune_sample_data));
+        const vector<Word> sample {gatherPoints(data, ids)};            // sampled points, packed like the index
+        const int s {static_cast<int>(ids.size())};
+        const vector<Word>& from {query.n > 0 ? query.data : sample};   // queries, or else the sample itself
+        const int nq {min(query.n > 0 ? query.n : s, tune_sample_query)};
+        const vector<Word> queries(from.begin(), from.begin() + static_cast<size_t>(nq) * words);
 
-// convert from bit vector to bit string
-string toString(const Point& point) {
-        string s(point.size(), '0');
-        for (int i {0}; s[i]; ++i) {
-                if (point[i])
-                        s[i] = '1';
-        }
-        return s;
-}
+        const OpCosts cost {measureOpCosts(sample, queries, words, param_d, param_n)};
+        cerr << "measured costs (ns): hash/bit = " << cost.hash
+             << ", lookup = " << cost.lookup
+             << ", collision = " << cost.collision
+             << ", verify = " << cost.verify
+             << ", query = " << cost.query << endl;
+
+        cerr << "k\tL\trecall\tMB\tcollisions\tcandidates\tus/query" << endl;
+        TuneEstimate best {0, 0, 0, 0, 0, 0, 0};
+        auto coordinate = bind(uniform_int_distribution<int>(0, param_d - 1), generator);
+        for (int k {1}; k < 64; ++k) {
+                // smallest L meeting the success probability, 1 - (1-P1^k)^L >= 1 - delta
+                const double p1 {pow(1 - static_cast<double>(param_r) / param_d, k)};
+                const double L_min {ceil(log(param_delta) / log(1 - p1))};
+                if (!(L_min >= 1) || L_min * param_n * sizeof(int) > param_memory)
+                        continue;               // cannot even store the indices
+                const int L {static_cast<int>(L_min)};
 
-// read points from file, where each line is a point in hamming space
-// each point is represented by a bit string of 0 and 1, deliminated by new lines
-// assuming all points have same dimension, i.e. the length of the bit string
-vector<Point> readPointsFromFile(const string& file) {
-        ifstream fin {file};
-        assert(fin.is_open());
-
-        vector<Point> points;
-        string point_str;
-        while (fin >> point_str) {
-                points.push_back(toPoint(point_str));   // no checking for point dimension
+                // fraction of the data sharing a query's bucket, and #buckets, for one table
+                double collide {0}, buckets {0};
+                for (int f {0}; f < tune_sample_functions; ++f) {
+                        vector<int> proj(k);
+                        for (auto& j : proj)
+                                j = coordinate();
+                        const PackedFunction function {packFunction(proj)};
+                        unordered_map<int64_t, int> count;
+                        for (int i {0}; i < s; ++i)
+                                ++count[packedBucketOf(function, sample.data() + static_cast<size_t>(i) * words)];
+                        buckets += count.size();
+                        for (int q {0}; q < nq; ++q) {
+                                auto it = count.find(packedBucketOf(function, queries.data() + static_cast<size_t>(q) * words));
+                                if (it != count.end())
+                                        collide += it->second;
+                        }
+                }
+                collide /= static_cast<double>(tune_sample_functions) * nq * s;
+                buckets = min(pow(2.0, k), buckets / tune_sample_functions * param_n / s);
+
+                TuneEstimate e;
+                e.k = k;
+                e.L = L;
+                e.recall = 1 - pow(1 - p1, L);
+                e.memory = L * (tableBytes(buckets, param_n) + sizeof(vector<int>) + k * sizeof(int));
+                e.collisions = L * collide * param_n;
+                e.candidates = param_n * (1 - pow(1 - collide, L));
+                e.time = cost.query + L * (k * cost.hash + cost.lookup)
+                         + (e.collisions > lsh.scan_fraction * param_n
+                            ? param_n * scan_cost       // the query's buckets are scanned instead
+                            : e.collisions * cost.collision + e.candidates * cost.verify);
+                cerr << e.k << '\t' << e.L << '\t' << e.recall << '\t' << e.memory / (1 << 20) << '\t'
+                     << e.collisions << '\t' << e.candidates << '\t' << e.time / 1000 << endl;
+                if (e.memory <= param_memory && (best.L == 0 || e.time < best.time))
+                        best = e;
         }
-        return points;
+        return best;
 }
 
 // perform r-near neighbor search
@@ -136,12 +163,18 @@ void NearNeighborSearch(const string& data_file,
                         const string& query_file,
                         const int param_r,                              // r-near
                         const int param_c,                              // c-approximate
-                        const double param_delta) {                     // failure probability
-        const vector<Point> data {readPointsFromFile(data_file)};       // data points
-        const vector<Point> query {readPointsFromFile(query_file)};     // query points
-        const int param_n {static_cast<int>(data.size())};              // number of data points
+                        const double param_delta,                       // failure probability
+                        const double param_memory,                      // index memory budget in MB, 0 to skip tuning
+                        const double param_scan) {                      // scan fraction, negative to calibrate
+        PackedPoints data {readPointsFromFile(data_file)};              // data points, packed
+        const PackedPoints query {readPointsFromFile(query_file)};      // query points, packed
+        const int param_n {data.n};                                     // number of data points
         assert(param_n > 0);
-        const int param_d {static_cast<int>(data.at(0).size())};        // dimension of points
+        const int param_d {data.d};                                     // dimension of points
+        if (query.n > 0 && query.d != param_d) {
+                cerr << "query points have dimension " << query.d << ", data points " << param_d << endl;
+                exit(EXIT_FAILURE);
+        }
         assert(param_r > 0);
         assert(param_delta > 0 && param_delta < 1);
 
@@ -151,44 +184,101 @@ void NearNeighborSearch(const string& data_file,
              << "d = " << param_d << endl
              << "n = " << param_n << endl
              << "delta = " << param_delta << endl
-             << "#query = " << query.size() << endl;
+             << "#query = " << query.n << endl
+             << "isa = " << kernels().name << endl;
 
-        // build LSH construction and add data points
+        // switch to a linear scan once merging buckets is predicted to be slower; calibrated before
+        // tuning, which predicts a scan for the settings whose buckets exceed the scan fraction
+        double scan_cost {0};                   // nanoseconds per data point of a linear scan
+        const double calibrated {param_scan < 0 || param_memory > 0
+                                 ? calibrateScanFraction(data.data, data.words, scan_cost) : 0};
+        lsh.scan_fraction = param_scan >= 0 ? param_scan : calibrated;
+        cerr << "scan fraction = " << lsh.scan_fraction << endl;
+
+        // choose k and L, either from the analysis or by measuring candidate settings
         using namespace std::chrono;
+        int param_k, param_L;
+        TuneEstimate tuned {0, 0, 0, 0, 0, 0, 0};
+        if (param_memory > 0) {
+                cerr << "memory budget = " << param_memory << "MB" << endl;
+                auto tune_start = high_resolution_clock::now();
+                tuned = autoTuneParams(param_r, param_d, param_delta, param_memory * (1 << 20), scan_cost, data, query);
+                auto tune_duration = duration_cast<milliseconds>(high_resolution_clock::now() - tune_start);
+                cerr << "Parameters tuned in " << tune_duration.count() << "ms" << endl;
+        }
+        if (tuned.L > 0) {
+                param_k = tuned.k;
+                param_L = tuned.L;
+        } else {
+                if (param_memory > 0)
+                        cerr << "No setting fits the memory budget, using default parameters" << endl;
+                chooseParams(param_c, param_r, param_d, param_n, param_delta, param_k, param_L);
+        }
+
+        // build LSH construction and add data points
+        lsh.packed_words = data.words;
+        lsh.packed_data = move(data.data);
         auto build_start = high_resolution_clock::now();
-        buildNearNeighborStruct(param_c, param_r, param_d, param_n, param_delta,
-                                data);
+        buildNearNeighborStruct(param_k, param_L, param_d);
         auto build_end = high_resolution_clock::now();
         auto build_duration = duration_cast<milliseconds>(build_end - build_start);
         cerr << "Data structure built in " << build_duration.count() << "ms" << endl;
 
         // query and output results
+        double search_ns {0};           // time spent in getNearNeighbors, excluding output
         auto query_start = high_resolution_clock::now();
-        for (int i {0}, sz {static_cast<int>(query.size())}; i < sz; ++i) {
-                vector<int> result {getNearNeighbors(query[i], param_r,
-                                                     data)};  // result is a vector of index for points in data
+        for (int i {0}; i < query.n; ++i) {
+                auto search_start = high_resolution_clock::now();
+                bool scanned;
+                vector<int> result {getNearNeighbors(lsh, query.data.data() + static_cast<size_t>(i) * query.words,
+                                                     param_r, scanned)};        // result is a vector of index for points in data
+                search_ns += elapsedNs(search_start);
 
                 // TODO should disable output for measuring query performance
-                cout << "Query point " << i << ": found " << result.size() << " NNs\n";
+                cout << "Query point " << i << ": found " << result.size() << " NNs by " << (scanned ? "scan" : "lsh") << "\n";
                 for (const auto& p : result) {
-                        cout << toString(data.at(p)) << '\n';
+                        cout << toString(unpackPoint(lsh.packed_data.data() + static_cast<size_t>(p) * lsh.packed_words, param_d))
+                             << '\n';
                 }
         }
         auto query_end = high_resolution_clock::now();
         auto query_duration = duration_cast<milliseconds>(query_end - query_start);
-        cerr << "Querying completed in " << query_duration.count() << "ms" << endl;
+        cerr << "Querying completed in " << query_duration.count() << "ms" << endl
+             << "#queries answered by scan = " << lsh.stat_scans << endl;
+
+        if (tuned.L > 0 && query.n > 0) {
+                const double nq {static_cast<double>(query.n)};
+                const int64_t merged {query.n - lsh.stat_scans};       // queries answered from their buckets
+                cerr << "predicted vs actual per query:" << endl
+                     << "  collisions = " << tuned.collisions << " vs " << lsh.stat_collisions / nq << endl
+                     << "  candidates = " << tuned.candidates << " vs ";
+                if (merged > 0)
+                        cerr << static_cast<double>(lsh.stat_candidates) / merged << " (over the " << merged
+                             << " queries answered by lsh)" << endl;
+                else
+                        cerr << "none (every query answered by scan)" << endl;
+                cerr << "  time = " << tuned.time / 1000 << "us vs " << search_ns / nq / 1000 << "us" << endl
+                     << "  index memory = " << tuned.memory / (1 << 20) << "MB vs " << indexBytes(lsh) / (1 << 20) << "MB" << endl;
+        }
 }
 
 int main(int argc, char* argv[]) {
-        if (argc != 5 && argc != 6) {
-                cerr << "Usage: " << argv[0] << " R C DataFile QueryFile [SuccessProb]\n"
+        parseIsaFlag(argc, argv);
+        if (argc < 5 || argc > 8) {
+                cerr << "Usage: " << argv[0] << " [--isa=NAME] R C DataFile QueryFile [SuccessProb] [MemoryMB] [ScanFraction]\n"
+                     << "       --isa=NAME      (optional) run the kernels built for NAME, one of " << supportedKernels() << "\n"
+                     << "                       by default the first one, the fastest this cpu supports\n"
                      << "       R               retrieve all points within hamming distance R\n"
                      << "       C               approximation factor\n"
                      << "       DataFile        file containing all data points of the same dimension\n"
                      << "                       each point represented as a binary string in a line\n"
                      << "       QueryFile       file containing all query points\n"
                      << "       SuccessProb     (optional) success probability that a r-near neighbor is returned\n"
-                     << "                       default success probability is 0.9\n";
+                     << "                       default success probability is 0.9\n"
+                     << "       MemoryMB        (optional) auto-tune k and L for the fastest predicted query time\n"
+                     << "                       that meets SuccessProb within MemoryMB of index memory\n"
+                     << "       ScanFraction    (optional) scan all points when the query's buckets hold more than\n"
+                     << "                       ScanFraction * n entries; by default calibrated from measured costs\n";
                 return EXIT_FAILURE;
         }
 
@@ -197,10 +287,16 @@ int main(int argc, char* argv[]) {
         const string data_file {argv[3]};
         const string query_file {argv[4]};
         double param_delta {1 - 0.9};           // default success probability 0.9
-        if (argc == 6)
+        if (argc >= 6)
                 param_delta = 1-stod(argv[5]);
+        double param_memory {0};                // by default no auto-tuning
+        if (argc >= 7)
+                param_memory = stod(argv[6]);
+        double param_scan {-1};                 // by default calibrate the scan fraction
+        if (argc == 8)
+                param_scan = stod(argv[7]);
 
-        NearNeighborSearch(data_file, query_file, param_r, param_c, param_delta);
+        NearNeighborSearch(data_file, query_file, param_r, param_c, param_delta, param_memory, param_scan);
 
         return EXIT_SUCCESS;
 }